@@ -0,0 +1,135 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <string>
+#include <cstdint>
+#include <thread>
+#include <stdexcept>
+#include <stop_token>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+
+// Interface
+export module Background;
+
+import SpscQueue;
+import ThreadAffinity;
+
+using namespace cv;
+
+// What goes behind the persons.
+export enum class BackgroundMode {
+    COLOR,   // The flat green screen color.
+    IMAGE,   // A still picture, scaled once to the frame size.
+    VIDEO,   // A looping video, decoded ahead on its own thread.
+    BLUR     // The live frame, blurred.
+};
+
+export struct BackgroundSettings
+{
+    BackgroundMode mode = BackgroundMode::COLOR;
+    std::string path;    // Image or video file.
+};
+
+// Backgrounds made to the frame size before compositing needs them, so compositing over one stays a single pass.
+// Next is called from one stage only.
+export class BackgroundSource
+{
+private:
+    static constexpr size_t VIDEO_AHEAD = 8;   // Video frames decoded ahead. A power of 2.
+    static constexpr int BLUR_SCALE = 4;       // Blur at 1/4 of the frame size each way, 1/16 of the pixels.
+    static constexpr int BLUR_KERNEL = 9;      // Box size at the reduced scale. About 36 pixels in the frame.
+
+    BackgroundMode mMode;
+    Size mSize;
+    Mat mImgBackground;                        // Image: the scaled picture. Video: the current frame. Blur: the last one.
+    Mat mImgSmall, mImgSmallBlurred;           // Blur.
+    VideoCapture mVideo;                       // Only read by the decoder thread once it runs.
+    SpscQueue<Mat, VIDEO_AHEAD> mVideoFrames;  // Decoder thread -> Next.
+    std::jthread mVideoDecoder;                // Declared last. Stopped and joined first.
+
+    void DecodeVideo(std::stop_token stopToken);
+
+public:
+    // Throws if the image or video cannot be opened.
+    BackgroundSource(const BackgroundSettings& settings, const Size& frameSize);
+    BackgroundSource(const BackgroundSource&) = delete;
+    BackgroundSource& operator=(const BackgroundSource&) = delete;
+
+    // The flat color. Compositing needs no image then.
+    bool Solid() const noexcept { return mMode == BackgroundMode::COLOR; }
+    // BGR background for the next frame, of the frame size. imgColor: the live frame, BGR or RGB if rgb. Only
+    // blur reads it. Valid until the next call.
+    const Mat& Next(const Mat& imgColor, const bool rgb);
+};
+
+module: private;
+
+// Scale to fill size, cropping the middle of src to the aspect ratio of size first. Nothing is stretched.
+static void ScaleToCover(const Mat& src, const Size& size, Mat& dst)
+{
+    Rect crop(0, 0, src.cols, src.rows);
+    if (static_cast<int64_t>(src.cols) * size.height > static_cast<int64_t>(src.rows) * size.width) {
+        crop.width = static_cast<int>(static_cast<int64_t>(src.rows) * size.width / size.height);
+        crop.x = (src.cols - crop.width) / 2;
+    }
+    else {
+        crop.height = static_cast<int>(static_cast<int64_t>(src.cols) * size.height / size.width);
+        crop.y = (src.rows - crop.height) / 2;
+    }
+    resize(src(crop), dst, size, 0, 0, crop.width > size.width ? INTER_AREA : INTER_LINEAR);
+}
+
+BackgroundSource::BackgroundSource(const BackgroundSettings& settings, const Size& frameSize)
+    : mMode(settings.mode), mSize(frameSize)
+{
+    if (mMode == BackgroundMode::IMAGE) {
+        const Mat imgPicture = imread(settings.path, IMREAD_COLOR);
+        if (imgPicture.empty()) throw std::runtime_error("Cannot read background image: " + settings.path);
+        ScaleToCover(imgPicture, mSize, mImgBackground);
+    }
+    else if (mMode == BackgroundMode::VIDEO) {
+        if (!mVideo.open(settings.path)) throw std::runtime_error("Cannot open background video: " + settings.path);
+        mImgBackground = Mat::zeros(mSize, CV_8UC3);   // Until the first frame is decoded.
+        mVideoDecoder = std::jthread([this](std::stop_token stopToken) { DecodeVideo(stopToken); });
+    }
+}
+
+void BackgroundSource::DecodeVideo(std::stop_token stopToken)
+{
+    EnterRole(ThreadRole::WORKER);   // Shares the worker cores.
+    Mat imgFrame;
+    while (!stopToken.stop_requested())
+    {
+        if (!mVideo.read(imgFrame)) {
+            // End of the video. Start over, or keep the last frame if it cannot seek.
+            if (!mVideo.set(CAP_PROP_POS_FRAMES, 0) || !mVideo.read(imgFrame)) return;
+        }
+        // A new Mat per frame. Its buffer comes back from the frame pool once Next has let go of it.
+        Mat imgScaled;
+        ScaleToCover(imgFrame, mSize, imgScaled);
+        if (!mVideoFrames.Push(imgScaled, stopToken)) return;
+    }
+}
+
+const Mat& BackgroundSource::Next(const Mat& imgColor, const bool rgb)
+{
+    switch (mMode) {
+    case BackgroundMode::VIDEO: {
+        // One video frame per camera frame. If the decoder falls behind, the current frame stays.
+        Mat imgFrame;
+        if (mVideoFrames.TryPop(imgFrame)) mImgBackground = imgFrame;
+        break;
+    }
+    case BackgroundMode::BLUR:
+        // Box blur is separable and its cost does not depend on the kernel size. Upsampling smooths it further.
+        resize(imgColor, mImgSmall, Size(mSize.width / BLUR_SCALE, mSize.height / BLUR_SCALE), 0, 0, INTER_AREA);
+        blur(mImgSmall, mImgSmallBlurred, Size(BLUR_KERNEL, BLUR_KERNEL));
+        if (rgb) cvtColor(mImgSmallBlurred, mImgSmallBlurred, COLOR_RGB2BGR);
+        resize(mImgSmallBlurred, mImgBackground, mSize, 0, 0, INTER_LINEAR);
+        break;
+    default:
+        break;
+    }
+    return mImgBackground;
+}
@@ -0,0 +1,368 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <ostream>
+#include <stdexcept>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+#include <libobsensor/hpp/Context.hpp>
+#include <libobsensor/hpp/Device.hpp>
+#include <libobsensor/hpp/Pipeline.hpp>
+
+// Interface
+export module Benchmark;
+
+import Const;
+import LatencyStats;
+import ThreadAffinity;
+import TripleBuffer;
+import FramePairing;
+import FrameCapture;
+import CameraSession;
+import Options;
+import SimdPath;
+import DepthKernel;
+import CompositeKernel;
+import MaskCleanup;
+import Background;
+
+using namespace cv;
+
+// Run the benchmark named in the options and print the results.
+export void RunBenchmark(const Options& options, std::ostream& os);
+
+module: private;
+
+constexpr auto JITTER_PERIOD = std::chrono::microseconds(33333);   // A capture thread at 30 fps.
+constexpr int JITTER_TICKS = 300;                                  // 10 s per run.
+
+// Lateness of a periodic capture-like thread while every core is busy with image processing.
+static LatencyHistogram MeasureJitter(const ThreadPlacement& placement)
+{
+    ConfigureThreads(placement);
+    std::atomic<bool> loaded{ true };
+    std::vector<std::jthread> load;
+    const unsigned numLoad = std::max(1U, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < numLoad; i++)
+    {
+        load.emplace_back([&loaded] {
+            EnterRole(ThreadRole::WORKER);
+            Mat imgSrc(H, W, CV_8UC3), imgDst;
+            randu(imgSrc, Scalar::all(0), Scalar::all(255));
+            while (loaded) GaussianBlur(imgSrc, imgDst, Size(15, 15), 0);
+        });
+    }
+
+    LatencyHistogram lateness;
+    std::jthread capture([&lateness] {
+        EnterRole(ThreadRole::CAPTURE);
+        auto deadline = std::chrono::steady_clock::now();
+        for (int i = 0; i < JITTER_TICKS; i++)
+        {
+            deadline += JITTER_PERIOD;
+            std::this_thread::sleep_until(deadline);
+            lateness.Record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - deadline).count());
+        }
+    });
+    capture.join();
+    loaded = false;
+    return lateness;
+}
+
+// Without a placement, keep core 0 for capture and give the rest to the workers.
+static ThreadPlacement PinnedPlacement(ThreadPlacement placement)
+{
+    const int capture = static_cast<int>(ThreadRole::CAPTURE);
+    const int worker = static_cast<int>(ThreadRole::WORKER);
+    if (placement.cpus[capture] || placement.cpus[worker]) return placement;
+    const unsigned cores = std::min(64U, std::max(2U, std::thread::hardware_concurrency()));
+    placement.cpus[capture] = 1;
+    placement.cpus[worker] = (cores == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << cores) - 1) & ~uint64_t{ 1 };
+    return placement;
+}
+
+static void BenchmarkJitter(const ThreadPlacement& placement, std::ostream& os)
+{
+    os << "Capture thread wake-up lateness, " << JITTER_TICKS << " ticks at 30 fps, all cores loaded:\n";
+    ThreadPlacement unpinned;
+    unpinned.realtimeCapture = placement.realtimeCapture;
+    PrintPercentiles(os, "unpinned", MeasureJitter(unpinned));
+    PrintPercentiles(os, "pinned", MeasureJitter(PinnedPlacement(placement)));
+    ConfigureThreads(placement);
+    os.flush();
+}
+
+constexpr auto PAIRING_DURATION = std::chrono::seconds(10);   // Per pairing mode.
+
+// Capture only, no processing. Every pair is taken as soon as it is written.
+static void MeasurePairing(std::shared_ptr<ob::Device> device, PairingSettings pairing, std::ostream& os)
+{
+    ob::Pipeline pipe(device);
+    TripleBuffer<FramePair> framePairs;
+    FrameCapture capture(pipe, framePairs);
+    std::shared_ptr<ob::VideoStreamProfile> colorProfile;
+    LatencyHistogram wait, skew;
+    uint64_t paired = 0, depthOnly = 0;
+
+    // Timestamp pairing may fall back to SDK sync. The report says which ran.
+    auto config = CameraSession::MakeConfig(pipe, pairing, ColorFormat::RGB888, colorProfile);
+    capture.Start(config, CaptureBackend::FRAME_CALLBACK, pairing);
+    {
+        std::jthread reader([&](std::stop_token stopToken) {
+            FramePair pair;
+            while (!stopToken.stop_requested())
+            {
+                framePairs.Wait(stopToken);
+                if (!framePairs.Read(pair) || !pair.depth) continue;
+                if (!pair.color) {
+                    depthOnly++;
+                    continue;
+                }
+                paired++;
+                const auto received = static_cast<int64_t>(std::min(pair.color->systemTimeStamp(), pair.depth->systemTimeStamp()));
+                wait.Record(static_cast<double>(pair.pairedSystemMs - received));
+                const auto colorMs = static_cast<int64_t>(pair.color->timeStamp());
+                const auto depthMs = static_cast<int64_t>(pair.depth->timeStamp());
+                skew.Record(static_cast<double>(colorMs > depthMs ? colorMs - depthMs : depthMs - colorMs));
+            }
+        });
+        std::this_thread::sleep_for(PAIRING_DURATION);
+    }
+    capture.Stop();
+
+    const double seconds = std::chrono::duration<double>(PAIRING_DURATION).count();
+    os << (pairing.mode == PairingMode::SDK_SYNC ? "SDK frame sync" : "timestamp pairing") << ": "
+        << paired / seconds << " pairs/s, " << depthOnly / seconds << " depth only/s, "
+        << framePairs.Overwritten() << " overwritten";
+    if (const FramePairer* pairer = capture.Pairer()) os << ", " << pairer->Unpaired() << " unpaired";
+    os << "\n";
+    PrintPercentiles(os, "  pairing wait", wait);
+    PrintPercentiles(os, "  color/depth skew", skew);
+}
+
+static void BenchmarkPairing(const PairingSettings& settings, std::ostream& os)
+{
+    ob::Context context;
+    const auto deviceList = context.queryDeviceList();
+    if (deviceList->deviceCount() == 0) throw std::runtime_error("No camera found.");
+    const auto device = deviceList->getDevice(0);
+
+    os << "Pairing on camera " << deviceList->serialNumber(0) << ", tolerance " << settings.toleranceMs << " ms:\n";
+    PairingSettings pairing = settings;
+    pairing.mode = PairingMode::SDK_SYNC;
+    MeasurePairing(device, pairing, os);
+    pairing.mode = PairingMode::TIMESTAMP;
+    MeasurePairing(device, pairing, os);
+    os.flush();
+}
+
+constexpr int KERNEL_ITERATIONS = 1000;   // Frames per kernel run.
+constexpr int DEPTH_SHIFT = 2;            // 12-bit depth.
+
+// Y16 like a camera gives it: a near person in front of a far wall, some holes, sensor noise.
+static Mat MakeSyntheticY16()
+{
+    Mat imgY16(H, W, CV_16UC1);
+    randu(imgY16, Scalar(3800 << DEPTH_SHIFT), Scalar(4400 << DEPTH_SHIFT));
+    Mat imgPerson(H * 3 / 4, W / 4, CV_16UC1);
+    randu(imgPerson, Scalar(90 * 16 << DEPTH_SHIFT), Scalar(100 * 16 << DEPTH_SHIFT));
+    imgPerson.copyTo(imgY16(Rect(W * 3 / 8, H / 4, W / 4, H * 3 / 4)));
+    Mat imgHoles(H, W, CV_8UC1);
+    randu(imgHoles, Scalar(0), Scalar(100));
+    imgY16.setTo(0, imgHoles < 3);
+    return imgY16;
+}
+
+template <typename Work>
+static double MsPerFrame(Work work)
+{
+    work();   // Warm up. Allocates the outputs.
+    TickMeter ticks;
+    ticks.start();
+    for (int i = 0; i < KERNEL_ITERATIONS; i++) work();
+    ticks.stop();
+    return ticks.getTimeMilli() / KERNEL_ITERATIONS;
+}
+
+static void PrintKernelRun(std::ostream& os, const std::string& name, const double ms, const int pixels = W * H)
+{
+    os << "  " << name << ": " << ms << " ms per frame, " << pixels / ms / 1000.0 << " MPix/s\n";
+}
+
+// The depth planes with the OpenCV calls they replace, and the fused kernel on each SIMD path.
+static void BenchmarkDepth(std::ostream& os)
+{
+    const Mat imgY16 = MakeSyntheticY16();
+    const Mat lut = MakeDepthLut(false);
+    Mat imgDepth, imgPreview, imgRangeMask, imgThumb, imgRangeBits;
+
+    os << "Y16 to 8-bit depth, RGB preview, range mask and 1/8 thumbnail, " << W << "x" << H << ", "
+        << KERNEL_ITERATIONS << " frames:\n";
+    PrintKernelRun(os, "OpenCV chain", MsPerFrame([&] {
+        convertScaleAbs(imgY16, imgDepth, 1.0 / (1 << DEPTH_SHIFT));
+        cvtColor(imgDepth, imgPreview, COLOR_GRAY2RGB);
+        inRange(imgDepth, DEPTH_MIN, DEPTH_MAX, imgRangeMask);
+        resize(imgDepth, imgThumb, Size(W / DEPTH_THUMB_SCALE, H / DEPTH_THUMB_SCALE), 0, 0, INTER_AREA);
+    }));
+    const Mat imgReference = imgDepth.clone();
+
+    for (const SimdPath path : SupportedSimdPaths())
+    {
+        PrintKernelRun(os, std::string("fused ") + SimdPathName(path), MsPerFrame([&] {
+            ConvertDepth(imgY16, DEPTH_SHIFT, lut, imgDepth, imgRangeBits, imgThumb, imgPreview, path);
+        }));
+        PrintKernelRun(os, std::string("fused ") + SimdPathName(path) + " without preview", MsPerFrame([&] {
+            ConvertDepth(imgY16, DEPTH_SHIFT, Mat(), imgDepth, imgRangeBits, imgThumb, imgPreview, path);
+        }));
+    }
+    // Ties round up here and to even in convertScaleAbs.
+    os << "  pixels off by one against convertScaleAbs: " << countNonZero(imgDepth != imgReference) << "\n";
+    os.flush();
+}
+
+// A person shaped mask with ragged edges, as 0/255 bytes.
+static Mat MakeSyntheticMask()
+{
+    Mat imgMask(H, W, CV_8UC1, Scalar(0));
+    ellipse(imgMask, Point(W / 2, H / 3), Size(W / 10, H / 7), 0, 0, 360, Scalar(255), FILLED);
+    rectangle(imgMask, Rect(W * 3 / 8, H / 2 - H / 20, W / 4, H / 2 + H / 20), Scalar(255), FILLED);
+    Mat imgNoise(H, W, CV_8UC1);
+    randu(imgNoise, Scalar(0), Scalar(100));
+    imgMask.setTo(0, imgNoise < 2);
+    return imgMask;
+}
+
+// The same mask as one bit per pixel, bit x % 8 of byte x / 8.
+static Mat PackBits(const Mat& imgMask)
+{
+    Mat imgBits(imgMask.rows, (imgMask.cols + 7) / 8, CV_8UC1, Scalar(0));
+    for (int y = 0; y < imgMask.rows; y++)
+    {
+        for (int x = 0; x < imgMask.cols; x++)
+        {
+            if (imgMask.at<uint8_t>(y, x)) imgBits.at<uint8_t>(y, x >> 3) |= static_cast<uint8_t>(1 << (x & 7));
+        }
+    }
+    return imgBits;
+}
+
+// Allocate, fill and masked copy, against the select kernel for each mask format, background and SIMD path.
+static void BenchmarkComposite(std::ostream& os)
+{
+    Mat imgColor(H, W, CV_8UC3), imgBackground(H, W, CV_8UC3), imgOut;
+    randu(imgColor, Scalar::all(0), Scalar::all(255));
+    randu(imgBackground, Scalar::all(0), Scalar::all(255));
+    const Mat imgMask = MakeSyntheticMask();
+    const Mat imgBits = PackBits(imgMask);
+    Mat imgAlpha;
+    blur(imgMask, imgAlpha, Size(5, 5));
+    const Scalar green(64, 177, 0);
+
+    os << "Composite, " << W << "x" << H << ", " << KERNEL_ITERATIONS << " frames:\n";
+    PrintKernelRun(os, "setTo and copyTo", MsPerFrame([&] {
+        Mat imgFilled(imgColor.size(), CV_8UC3);
+        imgFilled.setTo(green);
+        imgColor.copyTo(imgFilled, imgMask);
+        imgOut = imgFilled;
+    }));
+    const Mat imgReference = imgOut.clone();
+
+    const std::pair<const char*, MaskFormat> formats[] = {
+        { "bytes", MaskFormat::BYTES }, { "bits", MaskFormat::BITS }, { "alpha", MaskFormat::ALPHA } };
+    int mismatches = 0;
+    for (const SimdPath path : SupportedSimdPaths())
+    {
+        for (const auto& [formatName, format] : formats)
+        {
+            const Mat& mask = format == MaskFormat::BITS ? imgBits : format == MaskFormat::ALPHA ? imgAlpha : imgMask;
+            const std::string name = std::string(SimdPathName(path)) + " " + formatName;
+            PrintKernelRun(os, name + ", solid", MsPerFrame([&] {
+                CompositeColor(imgColor, false, mask, format, green, imgOut, path);
+            }));
+            if (format != MaskFormat::ALPHA) mismatches += countNonZero(imgOut.reshape(1) != imgReference.reshape(1));
+            PrintKernelRun(os, name + ", image", MsPerFrame([&] {
+                CompositeColor(imgColor, false, mask, format, imgBackground, imgOut, path);
+            }));
+            PrintKernelRun(os, name + ", RGB color", MsPerFrame([&] {
+                CompositeColor(imgColor, true, mask, format, green, imgOut, path);
+            }));
+        }
+    }
+    os << "  bytes differing from setTo and copyTo: " << mismatches << "\n";
+    os.flush();
+}
+
+// Open, close and hole fill of a mask with OpenCV's 8-bit morphology and a flood fill, against the bit packed
+// cleanup. Both start from a copy of the mask each frame.
+static void BenchmarkCleanup(std::ostream& os)
+{
+    const Mat imgMask = MakeSyntheticMask();
+    static const Mat openKernel = getStructuringElement(MORPH_RECT, Size(3, 3));
+    static const Mat closeKernel = getStructuringElement(MORPH_RECT, Size(5, 5));
+    Mat imgClean, imgFlood;
+    MaskCleanup cleanup;
+
+    os << "Mask open, close and hole fill, " << W << "x" << H << ", " << KERNEL_ITERATIONS << " frames:\n";
+    PrintKernelRun(os, "morphologyEx and floodFill", MsPerFrame([&] {
+        morphologyEx(imgMask, imgClean, MORPH_OPEN, openKernel);
+        morphologyEx(imgClean, imgClean, MORPH_CLOSE, closeKernel);
+        // A 1 pixel frame of background joins all of the border for one flood.
+        copyMakeBorder(imgClean, imgFlood, 1, 1, 1, 1, BORDER_CONSTANT, Scalar(0));
+        floodFill(imgFlood, Point(0, 0), Scalar(255));
+        imgClean.setTo(255, imgFlood(Rect(1, 1, W, H)) == 0);
+    }));
+    const Mat imgReference = imgClean.clone();
+    PrintKernelRun(os, "bit packed", MsPerFrame([&] {
+        imgMask.copyTo(imgClean);
+        cleanup.Clean(imgClean);
+    }));
+    os << "  pixels differing from OpenCV: " << countNonZero(imgClean != imgReference) << "\n";
+    os.flush();
+}
+
+constexpr int BACKGROUND_WIDTH = 1920;   // 1080p, the largest output the modes have to keep up with.
+constexpr int BACKGROUND_HEIGHT = 1080;
+
+// The per frame cost of each background mode with its composite, at 1080p. An image and a video cost the same on the
+// processing side: the video is decoded and scaled ahead on its own thread.
+static void BenchmarkBackground(std::ostream& os)
+{
+    const Size size(BACKGROUND_WIDTH, BACKGROUND_HEIGHT);
+    const int pixels = size.area();
+    Mat imgColor(size, CV_8UC3), imgPicture(size, CV_8UC3), imgMask, imgOut;
+    randu(imgColor, Scalar::all(0), Scalar::all(255));
+    randu(imgPicture, Scalar::all(0), Scalar::all(255));
+    resize(MakeSyntheticMask(), imgMask, size, 0, 0, INTER_NEAREST);
+    BackgroundSource blurred({ BackgroundMode::BLUR, "" }, size);
+
+    os << "Background and composite, " << size.width << "x" << size.height << ", " << KERNEL_ITERATIONS
+        << " frames, 33.3 ms per frame at 30 fps:\n";
+    PrintKernelRun(os, "green", MsPerFrame([&] {
+        CompositeColor(imgColor, false, imgMask, MaskFormat::BYTES, Scalar(64, 177, 0), imgOut);
+    }), pixels);
+    PrintKernelRun(os, "image or video", MsPerFrame([&] {
+        CompositeColor(imgColor, false, imgMask, MaskFormat::BYTES, imgPicture, imgOut);
+    }), pixels);
+    PrintKernelRun(os, "blur", MsPerFrame([&] {
+        CompositeColor(imgColor, false, imgMask, MaskFormat::BYTES, blurred.Next(imgColor, false), imgOut);
+    }), pixels);
+    os.flush();
+}
+
+void RunBenchmark(const Options& options, std::ostream& os)
+{
+    if (options.benchmark == "jitter") BenchmarkJitter(options.placement, os);
+    else if (options.benchmark == "pairing") BenchmarkPairing(options.pairing, os);
+    else if (options.benchmark == "depth") BenchmarkDepth(os);
+    else if (options.benchmark == "composite") BenchmarkComposite(os);
+    else if (options.benchmark == "cleanup") BenchmarkCleanup(os);
+    else if (options.benchmark == "background") BenchmarkBackground(os);
+    else throw std::invalid_argument("Unknown benchmark: " + options.benchmark);
+}
@@ -0,0 +1,206 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <ostream>
+#include <iostream>
+#pragma warning(disable: 4251 5054 6294 6201 6269)
+#include <opencv2/core.hpp>
+#include <libobsensor/hpp/Pipeline.hpp>
+#include <libobsensor/hpp/Device.hpp>
+#include <libobsensor/hpp/StreamProfile.hpp>
+#include <libobsensor/hpp/Error.hpp>
+
+// Interface
+export module CameraSession;
+
+import Const;
+import TripleBuffer;
+import FrameCapture;
+import FaceDetection;
+import HeadBlobDetector;
+import ProcessingPipeline;
+import LatencyStats;
+import WorkerPool;
+import QualityController;
+import FramePairing;
+import Options;
+import Background;
+
+// One camera with its own capture path, detector, tracker and statistics.
+// Nothing is shared with the other cameras but the worker pool.
+export class CameraSession
+{
+private:
+    std::string mSerial;
+    ob::Pipeline mPipe;
+    std::shared_ptr<ob::VideoStreamProfile> mColorProfile;
+    TripleBuffer<FramePair> mFramePairs;                      // Capture thread -> processing pipeline.
+    FrameCapture mCapture;
+    std::unique_ptr<FaceDetection> mFaceDet;
+    std::unique_ptr<ProcessingPipeline> mPipeline;            // After the detector. Destroyed before it.
+    LatencyStats mLatencyStats;
+    QualityController mQuality;
+    cv::TickMeter mTickMeter;                                 // Time between presented frames.
+    uint64_t mPresented = 0;
+
+    // Depth is aligned to color (D2C), so the color intrinsics apply. Scale them to the frame size.
+    static HeadBlobDetector MakeHeadBlobDetector(const OBCameraParam& cameraParam);
+
+public:
+    // budgetMs: work per frame the quality controller aims for.
+    CameraSession(std::shared_ptr<ob::Device> device, const std::string& serial, const double budgetMs);
+    ~CameraSession() { Stop(); }
+    CameraSession(const CameraSession&) = delete;
+    CameraSession& operator=(const CameraSession&) = delete;
+
+    // Start the color and depth streams.
+    void Start(const CaptureBackend backend, const PairingSettings& pairing, const ColorFormat color);
+    // Color and depth W x H at 30 fps, depth aligned to color. colorProfile gets the one used. Timestamp pairing
+    // without hardware D2C falls back to SDK sync in pairing, since everything downstream needs aligned depth.
+    static std::shared_ptr<ob::Config> MakeConfig(ob::Pipeline& pipe, PairingSettings& pairing,
+        const ColorFormat color, std::shared_ptr<ob::VideoStreamProfile>& colorProfile);
+    // Start the processing stages on the pool once the detector is loaded.
+    void StartProcessing(std::unique_ptr<FaceDetection> faceDet, WorkerPool& pool, const BackgroundSettings& background);
+    void Stop() { mCapture.Stop(); }
+
+    const std::string& Serial() const noexcept { return mSerial; }
+    int Width() const { return mColorProfile->width(); }
+    int Height() const { return mColorProfile->height(); }
+    ProcessingPipeline& Pipeline() noexcept { return *mPipeline; }
+    const LatencyStats& Stats() const noexcept { return mLatencyStats; }
+    cv::TickMeter& Ticks() noexcept { return mTickMeter; }
+    uint64_t Presented() const noexcept { return mPresented; }
+
+    // Present stage. Account a presented frame and adapt the quality to its cost.
+    void Record(const FrameSlot& slot);
+
+    void Report(std::ostream& os) const;
+};
+
+module: private;
+
+CameraSession::CameraSession(std::shared_ptr<ob::Device> device, const std::string& serial, const double budgetMs)
+    : mSerial(serial), mPipe(device), mCapture(mPipe, mFramePairs), mQuality(budgetMs)
+{
+}
+
+void CameraSession::Start(const CaptureBackend backend, const PairingSettings& pairing, const ColorFormat color)
+{
+    // Pairs go straight into mFramePairs.
+    PairingSettings used = pairing;
+    auto config = MakeConfig(mPipe, used, color, mColorProfile);
+    mCapture.Start(config, backend, used);
+}
+
+static OBFormat SdkFormat(const ColorFormat color)
+{
+    switch (color) {
+    case ColorFormat::MJPG: return OB_FORMAT_MJPG;
+    case ColorFormat::NV12: return OB_FORMAT_NV12;
+    case ColorFormat::NV21: return OB_FORMAT_NV21;
+    case ColorFormat::I420: return OB_FORMAT_I420;
+    case ColorFormat::YUYV: return OB_FORMAT_YUYV;
+    case ColorFormat::UYVY: return OB_FORMAT_UYVY;
+    default: return OB_FORMAT_RGB888;
+    }
+}
+
+std::shared_ptr<ob::Config> CameraSession::MakeConfig(ob::Pipeline& pipe, PairingSettings& pairing,
+    const ColorFormat color, std::shared_ptr<ob::VideoStreamProfile>& colorProfile)
+{
+    //获取彩色相机的所有流配置，包括流的分辨率，帧率，以及帧的格式
+    auto colorProfiles = pipe.getStreamProfileList(OB_SENSOR_COLOR);
+
+    //通过接口设置感兴趣项，返回对应Profile列表的首个Profile
+    colorProfile = colorProfiles->getVideoStreamProfile(W, H, SdkFormat(color), 30);
+    if (!colorProfile) {
+        colorProfile = colorProfiles->getProfile(0)->as<ob::VideoStreamProfile>();
+    }
+
+    // Software D2C needs the SDK's synced frame sets. Our own pairing needs depth aligned by the device. Without it
+    // the mask would be off the color, and of another size if the depth profile is.
+    auto hwD2CDepthProfiles = pairing.mode == PairingMode::TIMESTAMP
+        ? pipe.getD2CDepthProfileList(colorProfile, ALIGN_D2C_HW_MODE) : nullptr;
+    const bool hwD2C = hwD2CDepthProfiles && hwD2CDepthProfiles->count() > 0;
+    if (pairing.mode == PairingMode::TIMESTAMP && !hwD2C) {
+        std::cout << __FUNCTION__ << ": No hardware D2C for this color profile. Using SDK sync and software D2C."
+            << std::endl;
+        pairing.mode = PairingMode::SDK_SYNC;
+    }
+
+    //获取深度相机的所有流配置，包括流的分辨率，帧率，以及帧的格式
+    auto depthProfiles = hwD2C ? hwD2CDepthProfiles : pipe.getStreamProfileList(OB_SENSOR_DEPTH);
+
+    //通过接口设置感兴趣项，返回对应Profile列表的首个Profile
+    auto depthProfile = depthProfiles->getVideoStreamProfile(W, H, OB_FORMAT_Y16, 30);
+    if (!depthProfile) {
+        depthProfile = depthProfiles->getProfile(0)->as<ob::VideoStreamProfile>();
+    }
+
+    //通过创建Config来配置Pipeline要启用或者禁用哪些流，这里将启用彩色流和深度流
+    std::shared_ptr<ob::Config> config = std::make_shared<ob::Config>();
+    config->enableStream(colorProfile);
+    config->enableStream(depthProfile);
+
+    if (hwD2C) {
+        pipe.disableFrameSync();
+        config->setAlignMode(ALIGN_D2C_HW_MODE);
+    }
+    else {
+        pipe.enableFrameSync();
+        // 配置对齐模式为软件D2C对齐
+        config->setAlignMode(ALIGN_D2C_SW_MODE);
+    }
+
+    return config;
+}
+
+void CameraSession::StartProcessing(std::unique_ptr<FaceDetection> faceDet, WorkerPool& pool,
+    const BackgroundSettings& background)
+{
+    mFaceDet = std::move(faceDet);
+    mPipeline = std::make_unique<ProcessingPipeline>(mFramePairs, *mFaceDet,
+        MakeHeadBlobDetector(mPipe.getCameraParam()), pool, background, cv::Size(Width(), Height()));
+    mTickMeter.start();
+}
+
+void CameraSession::Record(const FrameSlot& slot)
+{
+    mLatencyStats.Record(slot.timing);
+    mPresented++;
+    if (!mQuality.Update(slot.timing, slot.qualityLevel)) return;
+
+    mPipeline->SetQualityLevel(mQuality.Level());
+    std::cout << "Camera " << mSerial << ": quality level " << mQuality.Level() << " of " << NUM_QUALITY_LEVELS - 1
+        << ", work " << mQuality.SmoothedMs() << " ms per frame, budget " << mQuality.BudgetMs() << " ms" << std::endl;
+}
+
+HeadBlobDetector CameraSession::MakeHeadBlobDetector(const OBCameraParam& cameraParam)
+{
+    const OBCameraIntrinsic& intrinsic = cameraParam.rgbIntrinsic;
+    if (intrinsic.width <= 0 || intrinsic.height <= 0) {
+        std::cout << __FUNCTION__ << ": No intrinsics from the camera. Assume a 70 degree horizontal FOV." << std::endl;
+        const float f = (W / 2.0F) / 0.7F;   // tan(35 degrees)
+        return HeadBlobDetector(f, f, H / 2.0F);
+    }
+    const float scaleX = static_cast<float>(W) / intrinsic.width;
+    const float scaleY = static_cast<float>(H) / intrinsic.height;
+    return HeadBlobDetector(intrinsic.fx * scaleX, intrinsic.fy * scaleY, intrinsic.cy * scaleY);
+}
+
+void CameraSession::Report(std::ostream& os) const
+{
+    os << "Camera " << mSerial << ": pairs captured: " << mFramePairs.Written()
+        << ", overwritten before processing: " << mFramePairs.Overwritten();
+    if (const FramePairer* pairer = mCapture.Pairer()) {
+        os << ", depth only: " << pairer->DepthOnly() << ", unpaired: " << pairer->Unpaired();
+    }
+    if (mPipeline) {
+        os << ", incomplete: " << mPipeline->Incomplete() << ", dropped in the pipeline: " << mPipeline->Dropped();
+    }
+    os << ", presented: " << mPresented << ", quality level: " << mQuality.Level() << "\n";
+    mLatencyStats.Report(os);
+}
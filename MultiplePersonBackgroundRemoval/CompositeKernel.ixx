@@ -0,0 +1,343 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+#include "simd.hpp"
+
+// Interface
+export module CompositeKernel;
+
+import SimdPath;
+
+using namespace cv;
+
+// How a mask tells person from background.
+export enum class MaskFormat {
+    BYTES,   // CV_8UC1. 0 is background, anything else person.
+    BITS,    // One bit per pixel, bit x % 8 of byte x / 8, like the range bits of ConvertDepth. (cols + 7) / 8 bytes a row.
+    ALPHA    // CV_8UC1. Weight of the color against the background, 0 to 255.
+};
+
+// out = mask ? color : background, in one pass. imgOut is reused if it has the shape already.
+// imgColor: CV_8UC3 BGR, or RGB if rgb. imgOut is always BGR and must not be imgColor.
+export void CompositeColor(const Mat& imgColor, const bool rgb, const Mat& mask, const MaskFormat format,
+    const Scalar& background, Mat& imgOut, SimdPath path = BestSimdPath());
+// Same over a BGR background image of the frame size: a still picture, or a live frame. imgOut may be imgBackground.
+export void CompositeColor(const Mat& imgColor, const bool rgb, const Mat& mask, const MaskFormat format,
+    const Mat& imgBackground, Mat& imgOut, SimdPath path = BestSimdPath());
+
+// c * a + b * (255 - a), divided by 255 and rounded. Exact for all inputs, and the same on every path.
+// Also blends the YUV composites, so alpha looks the same whatever the color format.
+export inline uint8_t Blend(const int c, const int b, const int a)
+{
+    const int t = c * a + b * (255 - a) + 128;
+    return static_cast<uint8_t>((t + (t >> 8)) >> 8);
+}
+
+module: private;
+
+// Where a row of the kernel reads and writes.
+struct CompositeRow
+{
+    const uint8_t* color;
+    const uint8_t* mask;         // Bytes or bits, from pixel 0 of the row.
+    const uint8_t* background;   // BGR.
+    uint8_t* out;
+    int cols;
+};
+
+template <MaskFormat F>
+static inline int MaskAt(const uint8_t* mask, const int x)
+{
+    if constexpr (F == MaskFormat::BITS) return (mask[x >> 3] >> (x & 7)) & 1 ? 255 : 0;
+    else if constexpr (F == MaskFormat::BYTES) return mask[x] ? 255 : 0;
+    else return mask[x];
+}
+
+// Pixels [x, cols). SWAP: the color is RGB.
+template <MaskFormat F, bool SWAP>
+static void CompositeRowScalar(const CompositeRow& row, int x)
+{
+    for (; x < row.cols; x++)
+    {
+        const uint8_t* color = row.color + x * 3;
+        const uint8_t* background = row.background + x * 3;
+        uint8_t* out = row.out + x * 3;
+        const uint8_t b = color[SWAP ? 2 : 0], g = color[1], r = color[SWAP ? 0 : 2];
+        const int a = MaskAt<F>(row.mask, x);
+        if constexpr (F == MaskFormat::ALPHA) {
+            out[0] = Blend(b, background[0], a);
+            out[1] = Blend(g, background[1], a);
+            out[2] = Blend(r, background[2], a);
+        }
+        else {
+            out[0] = a ? b : background[0];
+            out[1] = a ? g : background[1];
+            out[2] = a ? r : background[2];
+        }
+    }
+}
+
+#ifdef SIMD_SSSE3
+// pshufb controls for a group of 16 pixels, 48 bytes in 3 vectors. Byte i of vector k is byte 16k + i of the group.
+struct ShuffleControls
+{
+    uint8_t expand[3][16];     // The mask byte of each color byte.
+    uint8_t swap[3][3][16];    // [k][j]: the bytes of vector k that come from vector j with R and B swapped. 0x80: none.
+};
+
+constexpr ShuffleControls MakeShuffleControls()
+{
+    ShuffleControls controls{};
+    for (int k = 0; k < 3; k++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            const int n = 16 * k + i;
+            const int from = n - n % 3 + 2 - n % 3;
+            controls.expand[k][i] = static_cast<uint8_t>(n / 3);
+            for (int j = 0; j < 3; j++) controls.swap[k][j][i] = static_cast<uint8_t>(from / 16 == j ? from % 16 : 0x80);
+        }
+    }
+    return controls;
+}
+
+alignas(16) constexpr ShuffleControls SHUFFLE = MakeShuffleControls();
+
+static inline __m128i LoadControl(const uint8_t* control)
+{
+    return _mm_load_si128(reinterpret_cast<const __m128i*>(control));
+}
+
+// 16 bytes of Blend.
+static inline __m128i BlendSse(const __m128i c, const __m128i b, const __m128i a)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i na = _mm_xor_si128(a, _mm_set1_epi8(-1));   // 255 - a
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(a, zero)),
+        _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(na, zero))), round);
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(a, zero)),
+        _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(na, zero))), round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+// 16 pixels per step. Return the first pixel left for the scalar tail.
+template <MaskFormat F, bool SWAP>
+static int CompositeRowSsse3(const CompositeRow& row)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bitValues = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i bitBytes = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+    int x = 0;
+    for (; x + 16 <= row.cols; x += 16)
+    {
+        // One mask byte per pixel. All ones for a person with BYTES and BITS.
+        __m128i mask;
+        if constexpr (F == MaskFormat::BITS) {
+            uint16_t bits;
+            std::memcpy(&bits, row.mask + (x >> 3), sizeof(bits));
+            mask = _mm_and_si128(_mm_shuffle_epi8(_mm_cvtsi32_si128(bits), bitBytes), bitValues);
+            mask = _mm_cmpeq_epi8(mask, bitValues);
+        }
+        else {
+            mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row.mask + x));
+            if constexpr (F == MaskFormat::BYTES) mask = _mm_xor_si128(_mm_cmpeq_epi8(mask, zero), _mm_set1_epi8(-1));
+        }
+
+        const uint8_t* color = row.color + x * 3;
+        const uint8_t* background = row.background + x * 3;
+        uint8_t* out = row.out + x * 3;
+        __m128i c[3];
+        for (int k = 0; k < 3; k++) c[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(color + 16 * k));
+        if constexpr (SWAP) {
+            __m128i swapped[3];
+            for (int k = 0; k < 3; k++)
+            {
+                swapped[k] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c[0], LoadControl(SHUFFLE.swap[k][0])),
+                    _mm_shuffle_epi8(c[1], LoadControl(SHUFFLE.swap[k][1]))), _mm_shuffle_epi8(c[2], LoadControl(SHUFFLE.swap[k][2])));
+            }
+            for (int k = 0; k < 3; k++) c[k] = swapped[k];
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + 16 * k));
+            const __m128i m = _mm_shuffle_epi8(mask, LoadControl(SHUFFLE.expand[k]));
+            const __m128i o = F == MaskFormat::ALPHA ? BlendSse(c[k], b, m)
+                : _mm_or_si128(_mm_and_si128(m, c[k]), _mm_andnot_si128(m, b));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16 * k), o);
+        }
+    }
+    return x;
+}
+#endif
+
+#ifdef SIMD_AVX2
+// Two groups of 16 pixels, one per 128-bit lane, so the in-lane shuffles of the SSSE3 path apply as they are.
+static inline __m256i LoadGroups(const uint8_t* p)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48)), 1);
+}
+
+static inline void StoreGroups(uint8_t* p, const __m256i v)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(v));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 48), _mm256_extracti128_si256(v, 1));
+}
+
+static inline __m256i LoadControl2(const uint8_t* control)
+{
+    return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(control)));
+}
+
+static inline __m256i BlendAvx2(const __m256i c, const __m256i b, const __m256i a)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m256i na = _mm256_xor_si256(a, _mm256_set1_epi8(-1));
+    __m256i lo = _mm256_add_epi16(_mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_unpacklo_epi8(c, zero), _mm256_unpacklo_epi8(a, zero)),
+        _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(na, zero))), round);
+    __m256i hi = _mm256_add_epi16(_mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_unpackhi_epi8(c, zero), _mm256_unpackhi_epi8(a, zero)),
+        _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(na, zero))), round);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+    return _mm256_packus_epi16(lo, hi);   // Per lane, which keeps the bytes in order here.
+}
+
+// 32 pixels per step. Return the first pixel left for the SSSE3 and scalar tail.
+template <MaskFormat F, bool SWAP>
+static int CompositeRowAvx2(const CompositeRow& row)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bitValues = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i bitBytes = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    int x = 0;
+    for (; x + 32 <= row.cols; x += 32)
+    {
+        // Pixels x to x + 15 in the low lane, x + 16 to x + 31 in the high lane.
+        __m256i mask;
+        if constexpr (F == MaskFormat::BITS) {
+            uint32_t bits;
+            std::memcpy(&bits, row.mask + (x >> 3), sizeof(bits));
+            mask = _mm256_and_si256(_mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(bits)), bitBytes), bitValues);
+            mask = _mm256_cmpeq_epi8(mask, bitValues);
+        }
+        else {
+            mask = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row.mask + x));
+            if constexpr (F == MaskFormat::BYTES) mask = _mm256_xor_si256(_mm256_cmpeq_epi8(mask, zero), _mm256_set1_epi8(-1));
+        }
+
+        const uint8_t* color = row.color + x * 3;
+        const uint8_t* background = row.background + x * 3;
+        uint8_t* out = row.out + x * 3;
+        __m256i c[3];
+        for (int k = 0; k < 3; k++) c[k] = LoadGroups(color + 16 * k);
+        if constexpr (SWAP) {
+            __m256i swapped[3];
+            for (int k = 0; k < 3; k++)
+            {
+                swapped[k] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(c[0], LoadControl2(SHUFFLE.swap[k][0])),
+                    _mm256_shuffle_epi8(c[1], LoadControl2(SHUFFLE.swap[k][1]))),
+                    _mm256_shuffle_epi8(c[2], LoadControl2(SHUFFLE.swap[k][2])));
+            }
+            for (int k = 0; k < 3; k++) c[k] = swapped[k];
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            const __m256i b = LoadGroups(background + 16 * k);
+            const __m256i m = _mm256_shuffle_epi8(mask, LoadControl2(SHUFFLE.expand[k]));
+            StoreGroups(out + 16 * k, F == MaskFormat::ALPHA ? BlendAvx2(c[k], b, m) : _mm256_blendv_epi8(b, c[k], m));
+        }
+    }
+    return x;
+}
+#endif
+
+template <MaskFormat F, bool SWAP>
+static void CompositeRows(const Mat& imgColor, const Mat& mask, const uint8_t* background, const size_t backgroundStep,
+    Mat& imgOut, const SimdPath path)
+{
+    for (int y = 0; y < imgColor.rows; y++)
+    {
+        const CompositeRow row{ imgColor.ptr<uint8_t>(y), mask.ptr<uint8_t>(y), background + y * backgroundStep,
+            imgOut.ptr<uint8_t>(y), imgColor.cols };
+        int x = 0;
+#ifdef SIMD_AVX2
+        if (path == SimdPath::AVX2) x = CompositeRowAvx2<F, SWAP>(row);
+#endif
+#ifdef SIMD_SSSE3
+        // The 16 pixel steps continue where AVX2 stopped. A BITS row then starts on a whole byte.
+        if (path != SimdPath::SCALAR) {
+            CompositeRow tail = row;
+            tail.color += x * 3;
+            tail.mask += F == MaskFormat::BITS ? x >> 3 : x;
+            tail.background += x * 3;
+            tail.out += x * 3;
+            tail.cols -= x;
+            x += CompositeRowSsse3<F, SWAP>(tail);
+        }
+#endif
+        CompositeRowScalar<F, SWAP>(row, x);
+    }
+}
+
+template <MaskFormat F>
+static void CompositeRows(const Mat& imgColor, const bool rgb, const Mat& mask, const uint8_t* background,
+    const size_t backgroundStep, Mat& imgOut, const SimdPath path)
+{
+    if (rgb) CompositeRows<F, true>(imgColor, mask, background, backgroundStep, imgOut, path);
+    else CompositeRows<F, false>(imgColor, mask, background, backgroundStep, imgOut, path);
+}
+
+// backgroundStep 0 repeats one row.
+static void Composite(const Mat& imgColor, const bool rgb, const Mat& mask, const MaskFormat format,
+    const uint8_t* background, const size_t backgroundStep, Mat& imgOut, SimdPath path)
+{
+    CV_Assert(imgColor.type() == CV_8UC3 && mask.type() == CV_8UC1 && mask.rows == imgColor.rows);
+    CV_Assert(mask.cols == (format == MaskFormat::BITS ? (imgColor.cols + 7) / 8 : imgColor.cols));
+    imgOut.create(imgColor.size(), CV_8UC3);
+    CV_Assert(imgOut.data != imgColor.data);
+    // The 128-bit path needs SSSE3 for its byte shuffles. SSE2 only CPUs take the scalar loop.
+#ifdef SIMD_SSSE3
+    if (path != SimdPath::SCALAR && !checkHardwareSupport(CV_CPU_SSSE3)) path = SimdPath::SCALAR;
+#endif
+
+    switch (format) {
+    case MaskFormat::BYTES: CompositeRows<MaskFormat::BYTES>(imgColor, rgb, mask, background, backgroundStep, imgOut, path); break;
+    case MaskFormat::BITS: CompositeRows<MaskFormat::BITS>(imgColor, rgb, mask, background, backgroundStep, imgOut, path); break;
+    case MaskFormat::ALPHA: CompositeRows<MaskFormat::ALPHA>(imgColor, rgb, mask, background, backgroundStep, imgOut, path); break;
+    }
+}
+
+void CompositeColor(const Mat& imgColor, const bool rgb, const Mat& mask, const MaskFormat format,
+    const Scalar& background, Mat& imgOut, SimdPath path)
+{
+    // One row of the color, read again for every row.
+    thread_local std::vector<uint8_t> backgroundRow;
+    backgroundRow.resize(static_cast<size_t>(imgColor.cols) * 3);
+    for (size_t i = 0; i < backgroundRow.size(); i += 3)
+    {
+        backgroundRow[i] = saturate_cast<uint8_t>(background[0]);
+        backgroundRow[i + 1] = saturate_cast<uint8_t>(background[1]);
+        backgroundRow[i + 2] = saturate_cast<uint8_t>(background[2]);
+    }
+    Composite(imgColor, rgb, mask, format, backgroundRow.data(), 0, imgOut, path);
+}
+
+void CompositeColor(const Mat& imgColor, const bool rgb, const Mat& mask, const MaskFormat format,
+    const Mat& imgBackground, Mat& imgOut, SimdPath path)
+{
+    CV_Assert(imgBackground.type() == CV_8UC3 && imgBackground.size() == imgColor.size());
+    Composite(imgColor, rgb, mask, format, imgBackground.data, imgBackground.step, imgOut, path);
+}
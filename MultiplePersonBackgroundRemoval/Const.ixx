@@ -7,3 +7,11 @@ export constexpr int W = 640;
 export constexpr int W_1 = W - 1;
 export constexpr int H = 480;
 export constexpr int H_1 = H - 1;
+
+// One 8-bit depth unit in millimeters.
+export constexpr int DEPTH_UNIT_MM = 16;
+
+// Working depth range in 8-bit depth units (n*16mm). 0 is invalid depth.
+// Nothing outside of this range can seed a person.
+export constexpr int DEPTH_MIN = 1;
+export constexpr int DEPTH_MAX = 200;     // 3.2m
@@ -0,0 +1,209 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+#include "simd.hpp"
+
+// Interface
+export module DepthKernel;
+
+import Const;
+import SimdPath;
+
+using namespace cv;
+
+export constexpr int DEPTH_THUMB_SCALE = 8;   // The depth thumbnail is 1/8 of the frame, for the coarse stages.
+
+// 256 x 1 RGB table from 8-bit depth to the preview. Gray, or a color map with black for no depth.
+export Mat MakeDepthLut(const bool colorize);
+
+// Read the Y16 depth once and write every plane derived from it:
+//   imgDepth      8-bit depth, n*16mm. Y16 >> shift, rounded and saturated like convertScaleAbs.
+//   imgRangeBits  One bit per pixel, DEPTH_MIN <= depth <= DEPTH_MAX. Bit x % 8 of byte x / 8. No depth is out of range.
+//   imgThumb      1/8 depth thumbnail, the mean of each 8 x 8 block like INTER_AREA.
+//   imgPreview    RGB through lut. Only if lut is not empty.
+// shift: pixelAvailableBitSize - 10 of the depth frame.
+export void ConvertDepth(const Mat& imgY16, const int shift, const Mat& lut, Mat& imgDepth, Mat& imgRangeBits,
+    Mat& imgThumb, Mat& imgPreview, const SimdPath path = BestSimdPath());
+
+module: private;
+
+Mat MakeDepthLut(const bool colorize)
+{
+    // Colorized, near is warm and only the working range is spread over the map.
+    Mat ramp(1, 256, CV_8UC1);
+    for (int i = 0; i < 256; i++)
+    {
+        const int depth = std::clamp(i, DEPTH_MIN, DEPTH_MAX);
+        ramp.at<uint8_t>(i) = static_cast<uint8_t>(colorize ? 255 - (depth - DEPTH_MIN) * 255 / (DEPTH_MAX - DEPTH_MIN) : i);
+    }
+    Mat lut;
+    if (!colorize) {
+        cvtColor(ramp, lut, COLOR_GRAY2RGB);
+        return lut;
+    }
+    applyColorMap(ramp, lut, COLORMAP_JET);
+    cvtColor(lut, lut, COLOR_BGR2RGB);
+    lut.at<Vec3b>(0) = Vec3b(0, 0, 0);
+    return lut;
+}
+
+// Where a row of the kernel writes to.
+struct DepthRow
+{
+    const uint16_t* src;
+    uint8_t* depth;
+    uint8_t* bits;
+    uint16_t* thumbSums;   // Sum of the 8 pixels of each thumbnail column, accumulated over 8 rows.
+    int cols;
+    int thumbCols;
+};
+
+// Pixels [x, cols). Return cols.
+static int ConvertRowScalar(const DepthRow& row, int x, const int shift)
+{
+    const int round = shift > 0 ? 1 << (shift - 1) : 0;
+    for (; x < row.cols; x++)
+    {
+        const int depth = std::min((row.src[x] + round) >> shift, 255);
+        row.depth[x] = static_cast<uint8_t>(depth);
+        if (depth >= DEPTH_MIN && depth <= DEPTH_MAX) row.bits[x >> 3] |= static_cast<uint8_t>(1 << (x & 7));
+        if ((x >> 3) < row.thumbCols) row.thumbSums[x >> 3] += static_cast<uint16_t>(depth);
+    }
+    return x;
+}
+
+#ifdef SIMD_SSE2
+// 16 pixels per step. Return the first pixel left for the scalar tail.
+static int ConvertRowSse2(const DepthRow& row, const int shift)
+{
+    const __m128i round = _mm_set1_epi16(static_cast<short>(shift > 0 ? 1 << (shift - 1) : 0));
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m128i max8 = _mm_set1_epi16(255);
+    const __m128i rangeMin = _mm_set1_epi8(static_cast<char>(DEPTH_MIN));
+    const __m128i rangeMax = _mm_set1_epi8(static_cast<char>(DEPTH_MAX));
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= row.cols; x += 16)
+    {
+        __m128i lo = _mm_srl_epi16(_mm_adds_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.src + x)), round), count);
+        __m128i hi = _mm_srl_epi16(_mm_adds_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row.src + x + 8)), round), count);
+        // Unsigned min(v, 255) in SSE2. Pack saturates as signed, which is wrong above 32767.
+        lo = _mm_subs_epu16(lo, _mm_subs_epu16(lo, max8));
+        hi = _mm_subs_epu16(hi, _mm_subs_epu16(hi, max8));
+        const __m128i depth = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row.depth + x), depth);
+
+        const __m128i inRange = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(depth, rangeMin), depth),
+            _mm_cmpeq_epi8(_mm_min_epu8(depth, rangeMax), depth));
+        const uint16_t bits = static_cast<uint16_t>(_mm_movemask_epi8(inRange));
+        std::memcpy(row.bits + (x >> 3), &bits, sizeof(bits));
+
+        // Sum of each 8 pixels.
+        const __m128i sums = _mm_sad_epu8(depth, zero);
+        row.thumbSums[x >> 3] += static_cast<uint16_t>(_mm_cvtsi128_si32(sums));
+        row.thumbSums[(x >> 3) + 1] += static_cast<uint16_t>(_mm_extract_epi16(sums, 4));
+    }
+    return x;
+}
+#endif
+
+#ifdef SIMD_AVX2
+// 32 pixels per step. Return the first pixel left for the SSE2 and scalar tail.
+static int ConvertRowAvx2(const DepthRow& row, const int shift)
+{
+    const __m256i round = _mm256_set1_epi16(static_cast<short>(shift > 0 ? 1 << (shift - 1) : 0));
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m256i max8 = _mm256_set1_epi16(255);
+    const __m256i rangeMin = _mm256_set1_epi8(static_cast<char>(DEPTH_MIN));
+    const __m256i rangeMax = _mm256_set1_epi8(static_cast<char>(DEPTH_MAX));
+    const __m256i zero = _mm256_setzero_si256();
+    alignas(32) uint64_t sums[4];
+    int x = 0;
+    for (; x + 32 <= row.cols; x += 32)
+    {
+        const __m256i lo = _mm256_min_epu16(_mm256_srl_epi16(_mm256_adds_epu16(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row.src + x)), round), count), max8);
+        const __m256i hi = _mm256_min_epu16(_mm256_srl_epi16(_mm256_adds_epu16(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row.src + x + 16)), round), count), max8);
+        // Pack works per 128-bit lane. Put the pixels back in order.
+        const __m256i depth = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row.depth + x), depth);
+
+        const __m256i inRange = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(depth, rangeMin), depth),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(depth, rangeMax), depth));
+        const uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(inRange));
+        std::memcpy(row.bits + (x >> 3), &bits, sizeof(bits));
+
+        _mm256_store_si256(reinterpret_cast<__m256i*>(sums), _mm256_sad_epu8(depth, zero));
+        for (int i = 0; i < 4; i++) row.thumbSums[(x >> 3) + i] += static_cast<uint16_t>(sums[i]);
+    }
+    return x;
+}
+#endif
+
+void ConvertDepth(const Mat& imgY16, const int shift, const Mat& lut, Mat& imgDepth, Mat& imgRangeBits,
+    Mat& imgThumb, Mat& imgPreview, const SimdPath path)
+{
+    CV_Assert(imgY16.type() == CV_16UC1 && shift >= 0 && shift < 16);
+    CV_Assert(lut.empty() || (lut.type() == CV_8UC3 && lut.total() == 256));
+    const int cols = imgY16.cols;
+    const int rows = imgY16.rows;
+    const int thumbCols = cols / DEPTH_THUMB_SCALE;
+    const int thumbRows = rows / DEPTH_THUMB_SCALE;
+    imgDepth.create(rows, cols, CV_8UC1);
+    imgRangeBits.create(rows, (cols + 7) / 8, CV_8UC1);
+    imgThumb.create(thumbRows, thumbCols, CV_8UC1);
+    if (!lut.empty()) imgPreview.create(rows, cols, CV_8UC3);
+    const Vec3b* table = lut.empty() ? nullptr : lut.ptr<Vec3b>();
+
+    // Up to 8 * 8 * 255. Fits in 16 bits.
+    thread_local std::vector<uint16_t> thumbSums;
+    thumbSums.assign(thumbCols, 0);
+
+    for (int y = 0; y < rows; y++)
+    {
+        const DepthRow row{ imgY16.ptr<uint16_t>(y), imgDepth.ptr<uint8_t>(y), imgRangeBits.ptr<uint8_t>(y),
+            thumbSums.data(), cols, thumbCols };
+        std::memset(row.bits, 0, imgRangeBits.cols);
+
+        int x = 0;
+#ifdef SIMD_AVX2
+        if (path == SimdPath::AVX2) x = ConvertRowAvx2(row, shift);
+#endif
+#ifdef SIMD_SSE2
+        // The SSE2 steps continue where AVX2 stopped, 16 pixels at a time.
+        if (path != SimdPath::SCALAR) {
+            DepthRow tail = row;
+            tail.src += x;
+            tail.depth += x;
+            tail.bits += x >> 3;
+            tail.thumbSums += x >> 3;
+            tail.cols -= x;
+            tail.thumbCols -= x >> 3;
+            x += ConvertRowSse2(tail, shift);
+        }
+#endif
+        ConvertRowScalar(row, x, shift);
+
+        // The row is still in cache. Expand it through the table.
+        if (table) {
+            Vec3b* preview = imgPreview.ptr<Vec3b>(y);
+            for (int i = 0; i < cols; i++) preview[i] = table[row.depth[i]];
+        }
+
+        if ((y & (DEPTH_THUMB_SCALE - 1)) == DEPTH_THUMB_SCALE - 1 && y / DEPTH_THUMB_SCALE < thumbRows) {
+            uint8_t* thumb = imgThumb.ptr<uint8_t>(y / DEPTH_THUMB_SCALE);
+            for (int i = 0; i < thumbCols; i++)
+            {
+                thumb[i] = static_cast<uint8_t>((thumbSums[i] + 32) >> 6);
+                thumbSums[i] = 0;
+            }
+        }
+    }
+}
@@ -1,7 +1,12 @@
 //  Copyright 2022 Farmhand.
 
 module;
+#include <span>
+#include <numeric>
 #include <iostream>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
 #include <opencv2/dnn.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
@@ -12,57 +17,193 @@ export module FaceDetection;
 using namespace cv;
 using namespace std;
 
+// Detector limits. A crowd must not produce an unbounded number of seeds and floods.
+constexpr float SCORE_THRESHOLD = 0.9F;
+constexpr float NMS_THRESHOLD = 0.3F;
+constexpr int TOP_K = 50;        // Per detector run, before NMS.
+constexpr int MAX_SEEDS = 8;     // Face centers returned per frame.
+
+// Which faces get the seed budget first.
+export enum class SeedOrder {
+    LARGEST_FACE,    // Closest to the camera by face size.
+    NEAREST_DEPTH    // Closest to the camera by depth at the face center.
+};
+constexpr SeedOrder SEED_ORDER = SeedOrder::LARGEST_FACE;
+
+// One row of the YuNet result Mat.
+export struct FaceRow
+{
+    float x, y, w, h;          // Bounding box.
+    float landmarks[5][2];     // Eyes, nose tip, mouth corners. (x, y)
+    float score;
+};
+static_assert(sizeof(FaceRow) == 15 * sizeof(float), "FaceRow must match the YuNet result row.");
+
 export class FaceDetection
 {
 private:
     const string FD_MODEL_PATH = "face_detection_yunet_2022mar.onnx";
     Ptr<FaceDetectorYN> mFaceDetector;
-    Mat mFaces;  // Detection results in Mat, Rows == Faces.
+    Mat mFaces;  // Detection results in Mat, Rows == Faces. Preallocated for TOP_K faces.
+    int mNumFaces = 0;
+    Mat mRoiFaces;  // Detection results of one region of interest.
+    Mat mImgInput;  // Region of interest scaled down or swapped to BGR for the detector.
+    vector<int> mSeedOrder;    // Face indices, in seed budget order.
     vector<Point2i> mFaceCenters;
 
+    static const string& CheckedModelPath(const string& path) {
+        if (!filesystem::exists(path)) throw runtime_error("Face detection model not found: " + path);
+        return path;
+    }
+
+    static span<FaceRow> AsFaceRows(Mat& faces, const int rows) noexcept {
+        if (faces.empty()) return {};
+        return { reinterpret_cast<FaceRow*>(faces.ptr<float>()), static_cast<size_t>(rows) };
+    }
+
 public:
+    // Load the model eagerly. Throw if it is missing, instead of failing at the first detection.
     explicit FaceDetection(const int frameWidth = 640, const int frameHeight = 480) try
-        : mFaceDetector(FaceDetectorYN::create(FD_MODEL_PATH, "", Size(frameWidth, frameHeight))) {
+        : mFaceDetector(FaceDetectorYN::create(CheckedModelPath(FD_MODEL_PATH), "", Size(frameWidth, frameHeight),
+            SCORE_THRESHOLD, NMS_THRESHOLD, TOP_K)),
+        mFaces(TOP_K, sizeof(FaceRow) / sizeof(float), CV_32FC1) {
     }
     catch (const std::exception& e) {
+        // Rethrown when the handler ends, as from every constructor function-try-block.
         cout << __FUNCTION__ << " ERROR: " << e.what() << endl;
     }
 
-    // Return face centers.
-    const vector<Point2i>& Detect(const Mat& imgColor);
-    void Visualize(Mat& img, const double fps, const int thickness = 2) const;
+    // Run inferences on a synthetic full frame, so the one-time setup of the network is done before the first real
+    // frame. The DNN module keeps nothing per input shape, so a region of a new size still reshapes on its first run.
+    void WarmUp(const int runs);
+
+    // Return face centers. Only the regions of interest are searched. Nothing is searched if there are none.
+    // At most MAX_SEEDS centers, in SEED_ORDER. A scale below 1 is faster but loses small faces first.
+    // imgColor is BGR, or RGB if rgb. RGB is swapped in the detector input copy of each region only.
+    // If prescaled, imgColor is at scale already, e.g. from a scaled JPEG decode. The regions stay in frame coordinates.
+    const vector<Point2i>& Detect(const Mat& imgColor, const Mat& imgDepth, const vector<Rect>& rois,
+        const float scale = 1.0F, const bool rgb = false, const bool prescaled = false);
+    // All faces of the last detection. A view over the result buffer, valid until the next detection.
+    span<const FaceRow> Faces() const noexcept {
+        return { reinterpret_cast<const FaceRow*>(mFaces.ptr<float>()), static_cast<size_t>(mNumFaces) };
+    }
+    // Face boxes of the last detection.
+    void FaceBoxes(vector<Rect>& boxes) const;
+    static void Visualize(Mat& img, const vector<Rect>& faceBoxes, const vector<Point2i>& faceCenters,
+        const double fps, const int thickness = 2);
 };
 
 module: private;
 
-const vector<Point2i>& FaceDetection::Detect(const Mat& imgColor)
+const vector<Point2i>& FaceDetection::Detect(const Mat& imgColor, const Mat& imgDepth, const vector<Rect>& rois,
+    const float scale, const bool rgb, const bool prescaled)
 {
-    mFaceDetector->detect(imgColor, mFaces);
+    mNumFaces = 0;
+    const bool resized = scale != 1.0F && !prescaled;
+    const float inverse = 1.0F / scale;
+    for (const auto& roi : rois)
+    {
+        const Size inputSize = scale != 1.0F ? Size(cvRound(roi.width * scale), cvRound(roi.height * scale)) : roi.size();
+        // A prescaled image only needs the region cropped.
+        const Rect region = prescaled ? Rect(Point(cvRound(roi.x * scale), cvRound(roi.y * scale)), inputSize)
+            & Rect(0, 0, imgColor.cols, imgColor.rows) : roi;
+        // Scale first, so the channel swap runs on the smaller image.
+        if (resized) resize(imgColor(region), mImgInput, inputSize, 0, 0, INTER_AREA);
+        if (rgb) cvtColor(resized ? mImgInput : imgColor(region), mImgInput, COLOR_RGB2BGR);
+        const Mat imgInput = resized || rgb ? mImgInput : imgColor(region);
+        // Changing the input size reshapes the network. Skip it when unchanged, e.g. full frame.
+        if (mFaceDetector->getInputSize() != imgInput.size())
+            mFaceDetector->setInputSize(imgInput.size());
+        mFaceDetector->detect(imgInput, mRoiFaces);
+
+        // Move the results into frame coordinates.
+        for (auto& face : AsFaceRows(mRoiFaces, mRoiFaces.rows))
+        {
+            face.x = face.x * inverse + static_cast<float>(roi.x);
+            face.y = face.y * inverse + static_cast<float>(roi.y);
+            face.w *= inverse;
+            face.h *= inverse;
+            for (auto& landmark : face.landmarks)
+            {
+                landmark[0] = landmark[0] * inverse + static_cast<float>(roi.x);
+                landmark[1] = landmark[1] * inverse + static_cast<float>(roi.y);
+            }
+        }
+        // Append into the preallocated result buffer.
+        const int rows = min(mRoiFaces.rows, mFaces.rows - mNumFaces);
+        if (rows > 0) mRoiFaces.rowRange(0, rows).copyTo(mFaces.rowRange(mNumFaces, mNumFaces + rows));
+        mNumFaces += max(rows, 0);
+    }
+
+    const auto faces = Faces();
+    const auto centerOf = [](const FaceRow& face) {
+        return Point2i(static_cast<int>(face.x + face.w / 2), static_cast<int>(face.y + face.h / 2));
+    };
 
-    // Calculate the centers of all faces detected.
+    // Spend the seed budget on the closest faces first.
+    mSeedOrder.resize(faces.size());
+    iota(mSeedOrder.begin(), mSeedOrder.end(), 0);
+    const auto numSeeds = min<size_t>(faces.size(), MAX_SEEDS);
+    if constexpr (SEED_ORDER == SeedOrder::LARGEST_FACE) {
+        partial_sort(mSeedOrder.begin(), mSeedOrder.begin() + numSeeds, mSeedOrder.end(),
+            [&](const int a, const int b) { return faces[a].w * faces[a].h > faces[b].w * faces[b].h; });
+    }
+    else {
+        const Rect frame(0, 0, imgDepth.cols, imgDepth.rows);
+        const auto depthOf = [&](const int i) {
+            const Point2i center = centerOf(faces[i]);
+            const int depth = frame.contains(center) ? imgDepth.at<uint8_t>(center) : 0;
+            return depth ? depth : 256;   // No depth sorts last.
+        };
+        partial_sort(mSeedOrder.begin(), mSeedOrder.begin() + numSeeds, mSeedOrder.end(),
+            [&](const int a, const int b) { return depthOf(a) < depthOf(b); });
+    }
+
+    // Calculate the centers of the faces within the budget.
     mFaceCenters.clear();
-    for (int i = 0; i < mFaces.rows; i++)
+    for (size_t i = 0; i < numSeeds; i++)
     {
-        const auto x = mFaces.at<float>(i, 0) + mFaces.at<float>(i, 2) / 2;
-        const auto y = mFaces.at<float>(i, 1) + mFaces.at<float>(i, 3) / 2;
-        mFaceCenters.emplace_back(Point2i(static_cast<int>(x), static_cast<int>(y)));
+        mFaceCenters.emplace_back(centerOf(faces[mSeedOrder[i]]));
     }
     return mFaceCenters;
 }
 
-void FaceDetection::Visualize(Mat& img, const double fps, const int thickness) const
+void FaceDetection::WarmUp(const int runs)
+{
+    const Size inputSize = mFaceDetector->getInputSize();
+    Mat imgSynthetic(inputSize, CV_8UC3);
+    randu(imgSynthetic, Scalar::all(0), Scalar::all(255));
+    for (int i = 0; i < runs; i++)
+    {
+        mFaceDetector->detect(imgSynthetic, mRoiFaces);
+    }
+}
+
+void FaceDetection::FaceBoxes(vector<Rect>& boxes) const
+{
+    boxes.clear();
+    for (const auto& face : Faces())
+    {
+        boxes.emplace_back(static_cast<int>(face.x), static_cast<int>(face.y),
+            static_cast<int>(face.w), static_cast<int>(face.h));
+    }
+}
+
+void FaceDetection::Visualize(Mat& img, const vector<Rect>& faceBoxes, const vector<Point2i>& faceCenters,
+    const double fps, const int thickness)
 {
     // Label image with frame rate.
     putText(img, cv::format("RGB  FPS: %.1f", fps), Point(5, 15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 255, 0), 2);
 
     const auto markColor = Scalar(0, 255, 0);
-    for (int i = 0; i < mFaces.rows; i++) // For each face.
+    for (const auto& box : faceBoxes) // For each face.
     {
         // Draw bounding box.
-        rectangle(img, Rect2i(static_cast<int>(mFaces.at<float>(i, 0)), static_cast<int>(mFaces.at<float>(i, 1)),
-            static_cast<int>(mFaces.at<float>(i, 2)), static_cast<int>(mFaces.at<float>(i, 3))), 
-            markColor, thickness);
+        rectangle(img, box, markColor, thickness);
+    }
+    for (const auto& center : faceCenters) // For each face seeded.
+    {
         // Draw center of face.
-        circle(img, mFaceCenters.at(i), 2, markColor, thickness);
+        circle(img, center, 2, markColor, thickness);
     }
 }
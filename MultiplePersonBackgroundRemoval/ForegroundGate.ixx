@@ -0,0 +1,107 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <vector>
+#include <algorithm>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+
+// Interface
+export module ForegroundGate;
+
+import Const;
+import DepthKernel;
+
+using namespace cv;
+
+constexpr int GATE_SCALE = DEPTH_THUMB_SCALE;   // Foreground is searched on the depth thumbnail.
+constexpr int MIN_BLOB_AREA = 16;      // Thumbnail pixels. Smaller blobs are speckles, not persons.
+constexpr int BOX_PADDING = 32;        // Pixels. Faces may stick out of the depth blob due to D2C misalignment.
+constexpr int MIN_BOX_SIZE = 160;      // Pixels. Keep the detector input large enough for a close-up face.
+constexpr int BOX_ALIGN = 32;          // Pixels.
+constexpr double FULL_FRAME_RATIO = 0.6;   // Run one full frame detection instead if the boxes cover more.
+
+// Find the bounding boxes of in-range foreground depth, where faces could possibly be.
+export class ForegroundGate
+{
+private:
+    Mat mImgThumbMask;   // In-range foreground of the thumbnail.
+    Mat mLabels, mStats, mCentroids;
+    std::vector<Rect> mBoxes;
+
+public:
+    // Return the boxes in full frame coordinates. Empty if there is nothing in the working range.
+    // imgDepthThumb: the depth thumbnail from ConvertDepth.
+    const std::vector<Rect>& FindBoxes(const Mat& imgDepthThumb, const Size& frameSize);
+};
+
+module: private;
+
+// Round the size up, so the detector input size and the network shape take few values. A box at the edge is moved
+// into the frame rather than clipped, so its size stays aligned.
+static Rect AlignBox(Rect box, const Size& frameSize)
+{
+    box.width = std::min((box.width + BOX_ALIGN - 1) / BOX_ALIGN * BOX_ALIGN, frameSize.width);
+    box.height = std::min((box.height + BOX_ALIGN - 1) / BOX_ALIGN * BOX_ALIGN, frameSize.height);
+    box.x = std::clamp(box.x, 0, frameSize.width - box.width);
+    box.y = std::clamp(box.y, 0, frameSize.height - box.height);
+    return box;
+}
+
+// Merge overlapping boxes until none overlap.
+static void MergeOverlappingBoxes(std::vector<Rect>& boxes)
+{
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (size_t i = 0; i < boxes.size() && !merged; i++)
+        {
+            for (size_t j = i + 1; j < boxes.size(); j++)
+            {
+                if ((boxes[i] & boxes[j]).area() == 0) continue;
+                boxes[i] |= boxes[j];
+                boxes.erase(boxes.begin() + j);
+                merged = true;
+                break;
+            }
+        }
+    }
+}
+
+const std::vector<Rect>& ForegroundGate::FindBoxes(const Mat& imgDepthThumb, const Size& frameSize)
+{
+    mBoxes.clear();
+
+    inRange(imgDepthThumb, DEPTH_MIN, DEPTH_MAX, mImgThumbMask);
+    if (countNonZero(mImgThumbMask) < MIN_BLOB_AREA) return mBoxes;   // Empty scene. Skip detection.
+
+    const int numLabels = connectedComponentsWithStats(mImgThumbMask, mLabels, mStats, mCentroids, 8, CV_32S);
+    const Rect frame(Point(0, 0), frameSize);
+    for (int i = 1; i < numLabels; i++)   // Label 0 is the background.
+    {
+        if (mStats.at<int>(i, CC_STAT_AREA) < MIN_BLOB_AREA) continue;
+
+        Rect box(mStats.at<int>(i, CC_STAT_LEFT) * GATE_SCALE, mStats.at<int>(i, CC_STAT_TOP) * GATE_SCALE,
+            mStats.at<int>(i, CC_STAT_WIDTH) * GATE_SCALE, mStats.at<int>(i, CC_STAT_HEIGHT) * GATE_SCALE);
+        box -= Point(BOX_PADDING, BOX_PADDING);
+        box += Size(BOX_PADDING * 2, BOX_PADDING * 2);
+        // Grow small boxes around their center.
+        const int growW = std::max(0, MIN_BOX_SIZE - box.width);
+        const int growH = std::max(0, MIN_BOX_SIZE - box.height);
+        box -= Point(growW / 2, growH / 2);
+        box += Size(growW, growH);
+        mBoxes.push_back(AlignBox(box, frameSize));
+    }
+    MergeOverlappingBoxes(mBoxes);
+    for (auto& box : mBoxes) box = AlignBox(box, frameSize);   // A union is aligned no more.
+
+    // Many boxes over most of the frame cost more than a single full frame detection.
+    int area = 0;
+    for (const auto& box : mBoxes) area += box.area();
+    if (area > FULL_FRAME_RATIO * frame.area())
+    {
+        mBoxes.assign(1, frame);
+    }
+    return mBoxes;
+}
@@ -0,0 +1,118 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <memory>
+#include <thread>
+#include <iostream>
+#pragma warning(disable: 4251 6294 6201 6269)
+#include <libobsensor/hpp/Pipeline.hpp>
+#include <libobsensor/hpp/Error.hpp>
+
+// Interface
+export module FrameCapture;
+
+import TripleBuffer;
+import ThreadAffinity;
+import FramePairing;
+import LatencyStats;
+
+export enum class CaptureBackend {
+    FRAME_CALLBACK,    // The SDK calls back with each frame set. No polling thread.
+    POLLING            // A thread waits for frame sets with a timeout.
+};
+
+// Start the pipeline and deliver color/depth pairs into the processing handoff.
+export class FrameCapture
+{
+private:
+    static constexpr uint32_t POLLING_TIMEOUT_MS = 100;
+
+    ob::Pipeline& mPipe;
+    TripleBuffer<FramePair>& mFramePairs;
+    std::unique_ptr<FramePairer> mPairer;    // Null with SDK sync. Its frame sets are pairs already.
+    std::jthread mPollingThread;
+    CaptureBackend mBackend = CaptureBackend::FRAME_CALLBACK;
+    bool mStarted = false;
+
+    void StartPolling(std::shared_ptr<ob::Config> config);
+    void Deliver(std::shared_ptr<ob::FrameSet> frameSet);
+
+public:
+    FrameCapture(ob::Pipeline& pipe, TripleBuffer<FramePair>& framePairs) noexcept
+        : mPipe(pipe), mFramePairs(framePairs) {
+    }
+    ~FrameCapture() { Stop(); }
+
+    // Fall back to polling if the SDK refuses the callback.
+    void Start(std::shared_ptr<ob::Config> config, const CaptureBackend backend, const PairingSettings& pairing);
+    void Stop();
+    CaptureBackend Backend() const noexcept { return mBackend; }
+    const FramePairer* Pairer() const noexcept { return mPairer.get(); }
+};
+
+module: private;
+
+void FrameCapture::Start(std::shared_ptr<ob::Config> config, const CaptureBackend backend,
+    const PairingSettings& pairing)
+{
+    if (pairing.mode == PairingMode::TIMESTAMP) mPairer = std::make_unique<FramePairer>(mFramePairs, pairing);
+    if (backend == CaptureBackend::POLLING) {
+        StartPolling(config);
+        return;
+    }
+
+    try {
+        // Called on an SDK thread, one frame set at a time.
+        mPipe.start(config, [this](std::shared_ptr<ob::FrameSet> frameSet) {
+            // The SDK owns the thread. Place it on its first frame set.
+            thread_local const bool placed = [] { EnterRole(ThreadRole::CAPTURE); return true; }();
+            (void)placed;
+            if (frameSet) Deliver(std::move(frameSet));
+        });
+        mBackend = CaptureBackend::FRAME_CALLBACK;
+        mStarted = true;
+    }
+    catch (const ob::Error& e) {
+        std::cout << __FUNCTION__ << ": Frame set callback failed, polling instead. " << e.getMessage() << std::endl;
+        StartPolling(config);
+    }
+}
+
+void FrameCapture::StartPolling(std::shared_ptr<ob::Config> config)
+{
+    //启动在Config中配置的流，如果不传参数，将启动默认配置启动流
+    mPipe.start(config);
+    mBackend = CaptureBackend::POLLING;
+    mStarted = true;
+
+    mPollingThread = std::jthread([this](std::stop_token stopToken) {
+        EnterRole(ThreadRole::CAPTURE);
+        while (!stopToken.stop_requested()) {
+            //以阻塞的方式等待一帧数据，该帧是一个复合帧，里面包含配置里启用的所有流的帧数据，
+            //并设置帧的等待超时时间为100ms
+            auto frameSet = mPipe.waitForFrames(POLLING_TIMEOUT_MS);
+            if (!frameSet) continue;
+            Deliver(std::move(frameSet));   // Never blocks. Replaces an unprocessed pair.
+        }});
+}
+
+void FrameCapture::Deliver(std::shared_ptr<ob::FrameSet> frameSet)
+{
+    if (mPairer) {
+        // Unsynced frame sets may hold either stream or both.
+        mPairer->Push(frameSet->colorFrame(), frameSet->depthFrame());
+        return;
+    }
+    mFramePairs.Write({ frameSet->colorFrame(), frameSet->depthFrame(), SystemTimeMs() });
+}
+
+void FrameCapture::Stop()
+{
+    if (!mStarted) return;
+    mStarted = false;
+    if (mPollingThread.joinable()) {
+        mPollingThread.request_stop();
+        mPollingThread.join();
+    }
+    mPipe.stop();
+}
@@ -0,0 +1,128 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#pragma warning(disable: 4251 6294 6201 6269)
+#include <libobsensor/hpp/Frame.hpp>
+
+// Interface
+export module FramePairing;
+
+import TripleBuffer;
+import LatencyStats;
+
+// One color and one depth frame taken at about the same time.
+export struct FramePair
+{
+    std::shared_ptr<ob::ColorFrame> color;   // Null: depth only, the color stream lagged behind.
+    std::shared_ptr<ob::DepthFrame> depth;
+    int64_t pairedSystemMs = 0;               // Host system clock when the pair was complete.
+};
+
+export enum class PairingMode {
+    SDK_SYNC,     // The SDK syncs the streams and aligns depth to color in software. Frame sets as they come.
+    TIMESTAMP     // Our own pairing by device timestamp. Depth is aligned by the device if it can.
+};
+
+export struct PairingSettings
+{
+    PairingMode mode = PairingMode::SDK_SYNC;
+    int toleranceMs = 16;      // Largest color/depth device timestamp difference of a pair. Half a frame at 30 fps.
+    bool depthOnly = false;    // Pass depth on alone when no color comes within DEPTH_ONLY_AFTER_MS.
+};
+
+// Pairs color and depth frames by device timestamp. Each stream waits in a short queue for its partner.
+// Frames that cannot get a partner any more are dropped, or passed on as depth only.
+export class FramePairer
+{
+private:
+    static constexpr size_t QUEUE_SIZE = 4;                // Per stream. Beyond this the oldest frame is dropped.
+    static constexpr int64_t DEPTH_ONLY_AFTER_MS = 50;     // Host time a depth frame waits for its color.
+
+    template <typename Frame>
+    struct Queue
+    {
+        std::array<std::shared_ptr<Frame>, QUEUE_SIZE> frames;
+        size_t head = 0, count = 0;
+
+        std::shared_ptr<Frame>& Front() { return frames[head]; }
+        void Pop() { frames[head].reset(); head = (head + 1) % QUEUE_SIZE; count--; }
+        // Return false if the oldest frame had to make room.
+        bool Push(std::shared_ptr<Frame> frame)
+        {
+            const bool full = count == QUEUE_SIZE;
+            if (full) Pop();
+            frames[(head + count) % QUEUE_SIZE] = std::move(frame);
+            count++;
+            return !full;
+        }
+    };
+
+    TripleBuffer<FramePair>& mPairs;
+    PairingSettings mSettings;
+    std::mutex mMutex;     // The SDK may deliver the streams on different threads.
+    Queue<ob::ColorFrame> mColors;
+    Queue<ob::DepthFrame> mDepths;
+    std::atomic<uint64_t> mPaired{ 0 };
+    std::atomic<uint64_t> mDepthOnly{ 0 };
+    std::atomic<uint64_t> mUnpaired{ 0 };    // Dropped without a partner.
+
+    void Emit(std::shared_ptr<ob::ColorFrame> color, std::shared_ptr<ob::DepthFrame> depth)
+    {
+        (color ? mPaired : mDepthOnly).fetch_add(1, std::memory_order_relaxed);
+        mPairs.Write({ std::move(color), std::move(depth), SystemTimeMs() });
+    }
+
+    void Match()
+    {
+        while (mColors.count && mDepths.count)
+        {
+            const auto colorMs = static_cast<int64_t>(mColors.Front()->timeStamp());
+            const auto depthMs = static_cast<int64_t>(mDepths.Front()->timeStamp());
+            if (colorMs - depthMs <= mSettings.toleranceMs && depthMs - colorMs <= mSettings.toleranceMs) {
+                Emit(std::move(mColors.Front()), std::move(mDepths.Front()));
+                mColors.Pop();
+                mDepths.Pop();
+            }
+            else if (colorMs < depthMs) {
+                // Every later depth frame is newer still. This color frame has no partner.
+                mColors.Pop();
+                mUnpaired.fetch_add(1, std::memory_order_relaxed);
+            }
+            else {
+                if (mSettings.depthOnly) Emit(nullptr, std::move(mDepths.Front()));
+                else mUnpaired.fetch_add(1, std::memory_order_relaxed);
+                mDepths.Pop();
+            }
+        }
+
+        // Color lags behind. Do not hold the depth back for it.
+        while (mSettings.depthOnly && mDepths.count
+            && SystemTimeMs() - static_cast<int64_t>(mDepths.Front()->systemTimeStamp()) > DEPTH_ONLY_AFTER_MS)
+        {
+            Emit(nullptr, std::move(mDepths.Front()));
+            mDepths.Pop();
+        }
+    }
+
+public:
+    FramePairer(TripleBuffer<FramePair>& pairs, const PairingSettings& settings) noexcept
+        : mPairs(pairs), mSettings(settings) {
+    }
+
+    void Push(std::shared_ptr<ob::ColorFrame> color, std::shared_ptr<ob::DepthFrame> depth)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (color && !mColors.Push(std::move(color))) mUnpaired.fetch_add(1, std::memory_order_relaxed);
+        if (depth && !mDepths.Push(std::move(depth))) mUnpaired.fetch_add(1, std::memory_order_relaxed);
+        Match();
+    }
+
+    uint64_t Paired() const noexcept { return mPaired.load(std::memory_order_relaxed); }
+    uint64_t DepthOnly() const noexcept { return mDepthOnly.load(std::memory_order_relaxed); }
+    uint64_t Unpaired() const noexcept { return mUnpaired.load(std::memory_order_relaxed); }
+};
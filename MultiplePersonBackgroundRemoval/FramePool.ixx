@@ -0,0 +1,160 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <bit>
+#include <cstdint>
+#include <unordered_map>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/core.hpp>
+
+// Interface
+export module FramePool;
+
+import Const;
+
+using namespace cv;
+
+// Recycles Mat buffers. Installed as OpenCV's default allocator, it serves every Mat of the process: frame slots,
+// stage scratch, render and DNN buffers. A buffer goes back to the pool when its last Mat lets go of it, and the
+// next Mat of the same size class gets it again. Sizes are rounded up to 4 classes per power of 2, so shapes that
+// keep changing a little, e.g. DNN blobs reshaped for each face ROI, still find a buffer. Frame sized buffers are
+// not allocated again once the shapes of a run have been seen.
+export class FramePool : public MatAllocator
+{
+private:
+    static constexpr size_t ALIGNMENT = 64;                   // Cache line. Also the widest SIMD load.
+    static constexpr size_t MAX_FREE_BYTES = size_t{ 8 } * W * H * 4;   // 8 BGRA frames. Beyond, back to the heap.
+    static constexpr size_t MIN_CLASS = 256;                  // Smallest size class.
+
+    struct FreeBuffer
+    {
+        void* header;    // UMatData storage, reused as well.
+        uchar* data;
+    };
+
+    mutable std::mutex mMutex;
+    mutable std::unordered_map<size_t, std::vector<FreeBuffer>> mFree;   // By size class.
+    mutable size_t mFreeBytes = 0;
+    mutable std::atomic<uint64_t> mAllocations{ 0 };
+    mutable std::atomic<uint64_t> mReuses{ 0 };
+    mutable std::atomic<uint64_t> mReleases{ 0 };
+
+    // total rounded up to 2^k, 1.25 * 2^k, 1.5 * 2^k or 1.75 * 2^k. At most 25% more.
+    static size_t SizeClass(const size_t total) noexcept
+    {
+        if (total <= MIN_CLASS) return MIN_CLASS;
+        const size_t quarter = std::bit_floor(total - 1) / 4;
+        return (total + quarter - 1) / quarter * quarter;
+    }
+
+public:
+    UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step, AccessFlag flags,
+        UMatUsageFlags usageFlags) const override;
+    bool allocate(UMatData* u, AccessFlag flags, UMatUsageFlags usageFlags) const override;
+    void deallocate(UMatData* u) const override;
+
+    // Buffers taken from the heap. Frame buffers are steady once warmed up, unless a quality change brings new image
+    // sizes. DNN blobs of a new size class, or freed while the pool is full, still come from the heap.
+    uint64_t Allocations() const noexcept { return mAllocations.load(std::memory_order_relaxed); }
+    // Buffers handed out again from the pool.
+    uint64_t Reuses() const noexcept { return mReuses.load(std::memory_order_relaxed); }
+    // Buffers given back to the heap because the pool was full.
+    uint64_t Releases() const noexcept { return mReleases.load(std::memory_order_relaxed); }
+};
+
+// Make the pool OpenCV's default allocator. Call once at startup, before any Mat is allocated.
+// The pool is never destroyed, so Mats in statics can still be freed at exit.
+export FramePool& InstallFramePool();
+
+module: private;
+
+UMatData* FramePool::allocate(int dims, const int* sizes, int type, void* data0, size_t* step, AccessFlag,
+    UMatUsageFlags) const
+{
+    // Same as OpenCV's own allocator: steps from the innermost dimension out.
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--)
+    {
+        if (step) {
+            if (data0 && step[i] != CV_AUTOSTEP) {
+                CV_Assert(total <= step[i]);
+                total = step[i];
+            }
+            else step[i] = total;
+        }
+        total *= sizes[i];
+    }
+
+    if (data0) {
+        // User memory. Nothing to pool.
+        UMatData* u = new UMatData(this);
+        u->data = u->origdata = static_cast<uchar*>(data0);
+        u->size = total;
+        u->flags |= UMatData::USER_ALLOCATED;
+        return u;
+    }
+
+    const size_t capacity = SizeClass(total);
+    FreeBuffer buffer{ nullptr, nullptr };
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const auto found = mFree.find(capacity);
+        if (found != mFree.end() && !found->second.empty()) {
+            buffer = found->second.back();
+            found->second.pop_back();
+            mFreeBytes -= capacity;
+        }
+    }
+    if (buffer.data) mReuses.fetch_add(1, std::memory_order_relaxed);
+    else {
+        buffer.header = ::operator new(sizeof(UMatData));
+        buffer.data = static_cast<uchar*>(::operator new(capacity, std::align_val_t{ ALIGNMENT }));
+        mAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    UMatData* u = new (buffer.header) UMatData(this);
+    u->data = u->origdata = buffer.data;
+    u->size = total;
+    return u;
+}
+
+bool FramePool::allocate(UMatData* u, AccessFlag, UMatUsageFlags) const
+{
+    return u != nullptr;
+}
+
+void FramePool::deallocate(UMatData* u) const
+{
+    if (!u) return;
+    CV_Assert(u->urefcount == 0 && u->refcount == 0);
+    if (u->flags & UMatData::USER_ALLOCATED) {
+        delete u;
+        return;
+    }
+
+    const FreeBuffer buffer{ u, u->origdata };
+    const size_t capacity = SizeClass(u->size);
+    u->~UMatData();   // Keep the storage. The header is built again in it when the buffer is handed out.
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFreeBytes + capacity <= MAX_FREE_BYTES) {
+            mFree[capacity].push_back(buffer);
+            mFreeBytes += capacity;
+            return;
+        }
+    }
+    mReleases.fetch_add(1, std::memory_order_relaxed);
+    ::operator delete(buffer.data, std::align_val_t{ ALIGNMENT });
+    ::operator delete(buffer.header);
+}
+
+FramePool& InstallFramePool()
+{
+    static FramePool* pool = new FramePool();
+    Mat::setDefaultAllocator(pool);
+    return *pool;
+}
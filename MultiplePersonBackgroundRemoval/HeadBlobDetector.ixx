@@ -0,0 +1,112 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <vector>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+
+// Interface
+export module HeadBlobDetector;
+
+import Const;
+
+using namespace cv;
+
+// Where person seeds come from.
+export enum class SeedStrategy {
+    FACE_ONLY,     // YuNet face centers.
+    DEPTH_ONLY,    // Head blobs in depth. No DNN at all.
+    HYBRID         // Both. Also finds persons facing away from the camera.
+};
+
+constexpr float HEAD_WIDTH_MM = 160.0F;
+// Plausible head heights. Camera coordinates, Y axis points down from the optical axis.
+constexpr float HEAD_Y_MIN_MM = -1200.0F;
+constexpr float HEAD_Y_MAX_MM = 600.0F;
+constexpr int GRID_STEP = 4;             // Pixels. Candidates are sampled on a grid.
+constexpr int SILHOUETTE_MARGIN = 12;    // Depth units. Background must be at least this much farther.
+
+// Find person candidates directly in depth: head sized blobs sticking out of the silhouette.
+export class HeadBlobDetector
+{
+private:
+    float mFx, mFy, mCy;    // Color camera intrinsics, scaled to the frame size. Depth is aligned to color.
+    std::vector<Point2i> mHeadCenters;
+
+public:
+    HeadBlobDetector(const float fx, const float fy, const float cy) noexcept
+        : mFx(fx), mFy(fy), mCy(cy) {
+    }
+
+    // Return head centers. imgRangeBits: in-range depth from ConvertDepth.
+    const std::vector<Point2i>& Detect(const Mat& imgDepth, const Mat& imgRangeBits);
+    static void Visualize(Mat& img, const std::vector<Point2i>& headCenters, const int thickness = 2);
+};
+
+module: private;
+
+// True if there is no foreground at (x, y) as near as the head. Outside of the frame is background.
+static bool IsBackground(const Mat& imgDepth, const int x, const int y, const int headDepth)
+{
+    if (x < 0 || x > imgDepth.cols - 1 || y < 0 || y > imgDepth.rows - 1) return true;
+    const int depth = imgDepth.at<uint8_t>(y, x);
+    return depth == 0 || depth > headDepth + SILHOUETTE_MARGIN;
+}
+
+const std::vector<Point2i>& HeadBlobDetector::Detect(const Mat& imgDepth, const Mat& imgRangeBits)
+{
+    mHeadCenters.clear();
+
+    // Scanning from the top, the first hit of a person is the top of the head.
+    for (int y = 0; y < imgDepth.rows; y += GRID_STEP)
+    {
+        const uint8_t* bits = imgRangeBits.ptr<uint8_t>(y);
+        if (countNonZero(imgRangeBits.row(y)) == 0) continue;   // Nothing in the working range on this row.
+        const uint8_t* row = imgDepth.ptr<uint8_t>(y);
+        for (int x = 0; x < imgDepth.cols; x += GRID_STEP)
+        {
+            if (!(bits[x >> 3] & (1 << (x & 7)))) continue;
+            const int depth = row[x];
+
+            // Head radius in pixels at this distance.
+            const float depthMm = static_cast<float>(depth * DEPTH_UNIT_MM);
+            const int radius = static_cast<int>(mFx * HEAD_WIDTH_MM / 2 / depthMm);
+            if (radius < 2) continue;
+
+            const float headY = (y - mCy) * depthMm / mFy;
+            if (headY < HEAD_Y_MIN_MM || headY > HEAD_Y_MAX_MM) continue;
+
+            // Already found. Head tops are hit several times along the grid.
+            bool found = false;
+            for (const auto& head : mHeadCenters)
+            {
+                if (abs(head.x - x) < radius * 3 && abs(head.y - y) < radius * 3) { found = true; break; }
+            }
+            if (found) continue;
+
+            // Head shape: background above, left and right. Body below.
+            if (!IsBackground(imgDepth, x, y - radius * 2, depth)) continue;
+            if (!IsBackground(imgDepth, x - radius * 2, y, depth)) continue;
+            if (!IsBackground(imgDepth, x + radius * 2, y, depth)) continue;
+            const int yBody = y + radius * 3;
+            if (yBody > imgDepth.rows - 1 || IsBackground(imgDepth, x, yBody, depth)) continue;
+
+            // Seed at the head center if it is valid, else at the top of the head.
+            const int yCenter = y + radius;
+            if (abs(imgDepth.at<uint8_t>(yCenter, x) - depth) <= SILHOUETTE_MARGIN)
+                mHeadCenters.emplace_back(x, yCenter);
+            else
+                mHeadCenters.emplace_back(x, y);
+        }
+    }
+    return mHeadCenters;
+}
+
+void HeadBlobDetector::Visualize(Mat& img, const std::vector<Point2i>& headCenters, const int thickness)
+{
+    const auto markColor = Scalar(255, 0, 255);
+    for (const auto& head : headCenters)
+    {
+        circle(img, head, 6, markColor, thickness);
+    }
+}
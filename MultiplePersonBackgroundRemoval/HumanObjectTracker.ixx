@@ -3,6 +3,8 @@
 module;  // global module fragment area. Put #include directives here 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <algorithm>
 #pragma warning(disable: 5054 6294 6201 6269)
 #include <opencv2/opencv.hpp>
 #include <opencv2/core/types.hpp>
@@ -19,23 +21,54 @@ export class HumanObjectTracker
 {
 private:
     Mat mImgMaskAll;     // Mask for all persons. 0 and 255 binary image.
+    Mat mImgDepthLevel;  // Depth at the pyramid level.
+    Mat mImgMaskLevel;   // Mask at the pyramid level.
+    std::vector<Point2i> mSeedsLevel;
+
+    void Flood(const Mat& imgDepth, const std::vector<Point2i>& faceCenters, Mat& imgMask);
 
 public:
-    Mat& ProcessFrameWithFaces(const Mat& imgDepth, const std::vector<Point2i>& faceCenters);
+    // Level 0 floods at full resolution. Each level halves the resolution, about 4 times less work.
+    Mat& ProcessFrameWithFaces(const Mat& imgDepth, const std::vector<Point2i>& faceCenters, const int level = 0);
+    Mat& Mask() noexcept { return mImgMaskAll; }   // Of the last processed frame.
 };
 
 module: private;
 
-Mat& HumanObjectTracker::ProcessFrameWithFaces(const Mat& imgDepth, const std::vector<Point2i>& faceCenters)
+Mat& HumanObjectTracker::ProcessFrameWithFaces(const Mat& imgDepth, const std::vector<Point2i>& faceCenters,
+    const int level)
 {
-    mImgMaskAll = Mat::zeros(imgDepth.size(), CV_8UC1);     // Start with a blank mask.
+    if (level <= 0) {
+        Flood(imgDepth, faceCenters, mImgMaskAll);
+        return mImgMaskAll;
+    }
 
+    // Nearest neighbor keeps the depth edges. Averaging would blend a person into the background behind.
+    const double scale = 1.0 / (1 << level);
+    resize(imgDepth, mImgDepthLevel, Size(), scale, scale, INTER_NEAREST);
+    mSeedsLevel.clear();
     for (const auto& faceCenter : faceCenters)
     {
-        Mat imgMaskPerson = Mat::zeros(imgDepth.size(), CV_8UC1);  // Start with blank mask for each face.
-        DetectConnectedComponent(imgDepth, faceCenter, imgMaskPerson);
-        bitwise_or(mImgMaskAll, imgMaskPerson, mImgMaskAll);      // Combine into the overall mask.
+        mSeedsLevel.emplace_back(std::min(faceCenter.x >> level, mImgDepthLevel.cols - 1),
+            std::min(faceCenter.y >> level, mImgDepthLevel.rows - 1));
     }
-    
+    Flood(mImgDepthLevel, mSeedsLevel, mImgMaskLevel);
+    resize(mImgMaskLevel, mImgMaskAll, imgDepth.size(), 0, 0, INTER_NEAREST);
     return mImgMaskAll;
 }
+
+void HumanObjectTracker::Flood(const Mat& imgDepth, const std::vector<Point2i>& faceCenters, Mat& imgMask)
+{
+    imgMask.create(imgDepth.size(), CV_8UC1);   // Reused from the last frame.
+    imgMask.setTo(0);                           // Start with a blank mask.
+
+    for (const auto& faceCenter : faceCenters)
+    {
+        // Same person seeded twice, e.g. face and head. Flooding again would give the same component.
+        if (imgMask.at<uint8_t>(faceCenter.y, faceCenter.x)) continue;
+
+        // Flood straight into the overall mask. Components are disjoint, so a new one never runs into
+        // a person marked before.
+        DetectConnectedComponent(imgDepth, faceCenter, imgMask);
+    }
+}
@@ -0,0 +1,151 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <array>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+// Interface
+export module LatencyStats;
+
+export enum class Stage { CONVERT, DETECT, SEGMENT, REFINE, COMPOSITE, PRESENT, COUNT };
+constexpr int NUM_STAGES = static_cast<int>(Stage::COUNT);
+const std::array<std::string, NUM_STAGES> STAGE_NAMES = { "convert", "detect", "segment", "refine", "composite", "present" };
+
+using SteadyTime = std::chrono::steady_clock::time_point;
+
+// Timestamps of one frame, from the camera to the screen.
+export struct FrameTiming
+{
+    uint64_t deviceTimeStampMs = 0;         // Color frame, device clock.
+    uint64_t depthDeviceTimeStampMs = 0;    // Depth frame, device clock.
+    uint64_t systemTimeStampMs = 0;         // Color frame, host system clock when the SDK received it.
+    uint64_t depthSystemTimeStampMs = 0;    // Depth frame, host system clock when the SDK received it.
+    int64_t pairedSystemMs = 0;             // Host system clock when color and depth were paired.
+    int64_t pipelineEntrySystemMs = 0;      // Host system clock when the frame set entered our pipeline.
+    int64_t presentSystemMs = 0;            // Host system clock when the frame was shown.
+    std::array<SteadyTime, NUM_STAGES> stageBegin{};
+    std::array<SteadyTime, NUM_STAGES> stageEnd{};
+
+    void Begin(const Stage stage) noexcept { stageBegin[static_cast<int>(stage)] = std::chrono::steady_clock::now(); }
+    void End(const Stage stage) noexcept { stageEnd[static_cast<int>(stage)] = std::chrono::steady_clock::now(); }
+
+    // Time spent working on the frame, not waiting between the stages.
+    double WorkMs() const noexcept
+    {
+        double ms = 0;
+        for (int i = 0; i < NUM_STAGES; i++)
+        {
+            ms += std::chrono::duration<double, std::milli>(stageEnd[i] - stageBegin[i]).count();
+        }
+        return ms;
+    }
+};
+
+export int64_t SystemTimeMs() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Fixed bucket latency histogram. 0.1 ms resolution up to 1 s. Recording never allocates.
+export class LatencyHistogram
+{
+private:
+    static constexpr int BUCKETS_PER_MS = 10;
+    static constexpr int NUM_BUCKETS = 1000 * BUCKETS_PER_MS + 1;   // Last bucket: 1 s and over.
+    std::vector<uint32_t> mBuckets = std::vector<uint32_t>(NUM_BUCKETS, 0);
+    uint64_t mCount = 0;
+
+public:
+    void Record(const double ms) noexcept
+    {
+        const int bucket = ms <= 0 ? 0 : static_cast<int>(ms * BUCKETS_PER_MS);
+        mBuckets[bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1]++;
+        mCount++;
+    }
+
+    uint64_t Count() const noexcept { return mCount; }
+
+    // Upper bound of the bucket holding the given percentile, in ms.
+    double Percentile(const double percent) const noexcept
+    {
+        if (mCount == 0) return 0;
+        const auto target = static_cast<uint64_t>(percent / 100 * static_cast<double>(mCount - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < NUM_BUCKETS; i++)
+        {
+            seen += mBuckets[i];
+            if (seen >= target) return static_cast<double>(i + 1) / BUCKETS_PER_MS;
+        }
+        return static_cast<double>(NUM_BUCKETS) / BUCKETS_PER_MS;
+    }
+};
+
+// One line of percentiles.
+export void PrintPercentiles(std::ostream& os, const std::string& name, const LatencyHistogram& histogram)
+{
+    os << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(1)
+        << " p50 " << std::setw(7) << histogram.Percentile(50)
+        << " p95 " << std::setw(7) << histogram.Percentile(95)
+        << " p99 " << std::setw(7) << histogram.Percentile(99) << " ms  (" << histogram.Count() << ")\n";
+}
+
+// Aggregates the timing of presented frames. Single threaded: record from the present stage only.
+export class LatencyStats
+{
+private:
+    LatencyHistogram mEndToEnd;        // SDK receive -> present. Host system clock.
+    LatencyHistogram mPairingWait;     // Older of color and depth received -> paired. SDK sync or ours.
+    LatencyHistogram mSdkToPipeline;   // SDK receive -> our pipeline. Includes the SDK's software D2C alignment.
+    std::array<LatencyHistogram, NUM_STAGES> mStageTimes;    // Inside each stage.
+    std::array<LatencyHistogram, NUM_STAGES> mQueueWaits;    // Waiting before each stage.
+    LatencyHistogram mColorDepthSkew;  // |color - depth| device timestamps.
+    LatencyHistogram mDeviceInterval;  // Between presented frames, device clock.
+    uint64_t mLastDeviceTimeStampMs = 0;
+
+    static double Ms(const SteadyTime& from, const SteadyTime& to) noexcept
+    {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+public:
+    void Record(const FrameTiming& timing) noexcept
+    {
+        mEndToEnd.Record(static_cast<double>(timing.presentSystemMs - static_cast<int64_t>(timing.systemTimeStampMs)));
+        const auto received = static_cast<int64_t>(std::min(timing.systemTimeStampMs, timing.depthSystemTimeStampMs));
+        mPairingWait.Record(static_cast<double>(timing.pairedSystemMs - received));
+        mSdkToPipeline.Record(static_cast<double>(timing.pipelineEntrySystemMs - static_cast<int64_t>(timing.systemTimeStampMs)));
+        for (int i = 0; i < NUM_STAGES; i++)
+        {
+            mStageTimes[i].Record(Ms(timing.stageBegin[i], timing.stageEnd[i]));
+            if (i > 0) mQueueWaits[i].Record(Ms(timing.stageEnd[i - 1], timing.stageBegin[i]));
+        }
+        const auto skew = static_cast<int64_t>(timing.deviceTimeStampMs) - static_cast<int64_t>(timing.depthDeviceTimeStampMs);
+        mColorDepthSkew.Record(static_cast<double>(skew < 0 ? -skew : skew));
+        if (mLastDeviceTimeStampMs && timing.deviceTimeStampMs > mLastDeviceTimeStampMs)
+            mDeviceInterval.Record(static_cast<double>(timing.deviceTimeStampMs - mLastDeviceTimeStampMs));
+        mLastDeviceTimeStampMs = timing.deviceTimeStampMs;
+    }
+
+    void Report(std::ostream& os) const
+    {
+        os << "Latency per presented frame:\n";
+        PrintPercentiles(os, "end to end", mEndToEnd);
+        PrintPercentiles(os, "pairing wait", mPairingWait);
+        PrintPercentiles(os, "SDK to pipeline", mSdkToPipeline);
+        for (int i = 0; i < NUM_STAGES; i++)
+        {
+            if (i > 0) PrintPercentiles(os, "  wait " + STAGE_NAMES[i], mQueueWaits[i]);
+            PrintPercentiles(os, "  " + STAGE_NAMES[i], mStageTimes[i]);
+        }
+        PrintPercentiles(os, "color/depth skew", mColorDepthSkew);
+        PrintPercentiles(os, "device frame interval", mDeviceInterval);
+        os.flush();
+    }
+};
@@ -1,147 +1,306 @@
 // © Copyright 2022 Farmhand.
 
 // Main Program file.
-#include <mutex>
 #include <thread>
 #include <atomic>
 #include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+#include <csignal>
 #include <iostream>
+#include <algorithm>
 #pragma warning(disable: 4251 6294 6201 6269)
-#include <libobsensor/hpp/Pipeline.hpp>
+#include <libobsensor/hpp/Context.hpp>
+#include <libobsensor/hpp/Device.hpp>
 #include <libobsensor/hpp/Error.hpp>
 #include "window.hpp"
 
 import Const;
-import HumanObjectTracker;
 import FaceDetection;
+import HeadBlobDetector;
+import FrameCapture;
+import ProcessingPipeline;
+import LatencyStats;
+import Options;
+import OutputSink;
+import WorkerPool;
+import CameraSession;
+import Background;
+import ThreadAffinity;
+import Benchmark;
+import FramePool;
 
 // Constants
 const std::string WINDOW_TITLE = "Multiple-Person Background Removal Using Orbbec Femto Developer Kit";
-const cv::Scalar GREEN_SCREEN_COLOR(64, 177, 0);   // RGB: (0, 177, 64)
+constexpr CaptureBackend CAPTURE_BACKEND = CaptureBackend::FRAME_CALLBACK;
+constexpr auto UI_POLL_INTERVAL = std::chrono::milliseconds(30);   // Longest sleep between UI event polls.
+constexpr auto HEADLESS_POLL_INTERVAL = std::chrono::milliseconds(100);   // Longest sleep between quit checks.
+constexpr unsigned MIN_WORKERS = 3;   // One per pooled stage, so one camera still runs its stages in parallel.
+constexpr uint64_t POOL_WARM_UP_FRAMES = 100;   // Presented frames, all cameras. Buffers are still being pooled before.
 
 // Across threads.
-static std::mutex gMutexFrames;
-static std::shared_ptr<ob::FrameSet> gSpFrameSet;
-static std::atomic<bool> gQuitApp{ false };
+static std::atomic<bool> gQuitApp{ false };   // Set by signals in headless mode.
+
+static const auto gStartTime = std::chrono::steady_clock::now();
 
 using namespace cv;
 using namespace std::literals;
 
+using Cameras = std::vector<std::unique_ptr<CameraSession>>;
+
 
-static std::vector<Mat> GetSynchronizedFrames(Window& app)
+// Startup metric. Time to the first fully processed frame out of the pipeline.
+static void ReportFirstFrame()
 {
-    std::vector<Mat> mats;
-
-    // Limit the scope of the mutex lock.
-    std::unique_lock<std::mutex> lock(gMutexFrames);
-    auto colorFrame = gSpFrameSet->colorFrame();
-    auto depthFrame = gSpFrameSet->depthFrame();
-    if (colorFrame && depthFrame) {
-        mats = app.processFrames({ colorFrame, depthFrame });
-    }
-    gSpFrameSet.reset();   // Reset for next set.
-    return mats;
+    static bool firstFrame = true;
+    if (!firstFrame) return;
+    firstFrame = false;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - gStartTime);
+    std::cout << "Startup: first frame in " << elapsed.count() << " ms" << std::endl;
 }
 
-static void ProcessAndDisplayFrameSet(Window& app, HumanObjectTracker& hoTracker, FaceDetection& faceDet, TickMeter& tm)
+// Present stage. Display the newest frame out of the processing pipeline.
+static void DisplayFrame(Window& app, CameraSession& camera, FrameSlot* slot)
 {
-    static int frameNumber = 0;
+    static std::vector<Mat> panels;   // Present thread only. Keeps its capacity.
+    slot->timing.Begin(Stage::PRESENT);
+
+    // Pipeline throughput. Time between presented frames.
+    TickMeter& tm = camera.Ticks();
+    tm.stop();
+    const double fps = tm.getFPS();
+    tm.start();
 
-    if (!gSpFrameSet) {
-        app.render({}, RenderType::RENDER_SINGLE);  // No image to display.
-        return;
+    putText(slot->imgOut, "Output", Point(5, 15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 0, 0), 2);
+    if (slot->quality.preview) {
+        // Mark faces detected.
+        FaceDetection::Visualize(slot->imgColorPreview, slot->faceBoxes, slot->faceCenters, fps, 2);
+        HeadBlobDetector::Visualize(slot->imgColorPreview, slot->headCenters, 2);
+
+        putText(slot->imgDepthPreview, "Depth", Point(5, 15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 255, 0), 2);
+        panels.assign({ slot->imgColorPreview, slot->imgOut, slot->imgDepthPreview });
+        app.renderMats(panels, RenderType::RENDER_ONE_ROW);
+    }
+    else {
+        // Preview panels dropped by the quality controller.
+        panels.assign({ slot->imgOut });
+        app.renderMats(panels, RenderType::RENDER_SINGLE);
     }
+    slot->timing.End(Stage::PRESENT);
+    slot->timing.presentSystemMs = SystemTimeMs();
+    camera.Record(*slot);
+    camera.Pipeline().Recycle(slot);
+    ReportFirstFrame();
+}
 
-    tm.start();
-    frameNumber++;
-    auto mats = GetSynchronizedFrames(app);
-    if (2 != mats.size()) return;
+// Present stage without a window. Only the output image, or color and matte, goes to the sink.
+static void WriteFrame(CameraSession& camera, FrameSlot* slot, OutputSink& sink, const OutputLayout layout)
+{
+    slot->timing.Begin(Stage::PRESENT);
+    if (layout == OutputLayout::COMPOSITE) sink.Write(slot->imgOut, slot->outFourcc);
+    else sink.WriteMatte(slot->imgColor, slot->colorRgb, slot->Matte(), layout);
+    slot->timing.End(Stage::PRESENT);
+    slot->timing.presentSystemMs = SystemTimeMs();
+    camera.Record(*slot);
+    camera.Pipeline().Recycle(slot);
+    ReportFirstFrame();
+}
 
-    // 1. RGB image for face detection.
-    Mat& imgColor = mats.at(0);
-    const std::vector<Point2i>& faceCenters = faceDet.Detect(imgColor);
+// Pool buffers allocated since warm-up. Frame buffers are not, but DNN blobs of a new ROI size class can be.
+class AllocationCheck
+{
+private:
+    const FramePool& mPool;
+    uint64_t mWarmAllocations = 0;
+    uint64_t mWarmFrames = 0;
+    bool mWarm = false;
 
-    // 2. Depth image for human object tracking.
-    Mat& imgDepth = mats.at(1);    // Raw depth image. Mark it as the original depth image.
-    const Mat& imgTrackerAsMask = hoTracker.ProcessFrameWithFaces(imgDepth, faceCenters);
+public:
+    explicit AllocationCheck(const FramePool& pool) noexcept : mPool(pool) {}
 
-    // 3. Copy original image to masked area to create output image.
-    cv::Mat imgOut(imgColor.size(), CV_8UC3, GREEN_SCREEN_COLOR);
-    imgColor.copyTo(imgOut, imgTrackerAsMask);
+    void Update(const uint64_t presented) noexcept
+    {
+        if (mWarm || presented < POOL_WARM_UP_FRAMES) return;
+        mWarm = true;
+        mWarmAllocations = mPool.Allocations();
+        mWarmFrames = presented;
+    }
 
-    // 3. Mark faces detected.
-    tm.stop();
-    faceDet.Visualize(imgColor, tm.getFPS(), 2);
+    void Report(std::ostream& os, const uint64_t presented) const
+    {
+        os << "Frame buffers: " << mPool.Allocations() << " allocated, " << mPool.Reuses() << " reused, "
+            << mPool.Releases() << " released to the heap";
+        if (mWarm) os << ", " << mPool.Allocations() - mWarmAllocations << " allocated in " << presented - mWarmFrames
+            << " frames after warm-up (new image sizes after a quality change, DNN blobs of new face ROI sizes)";
+        os << std::endl;
+    }
+};
 
-    // RENDER_GRID needs all mats to be the same shape (480, 640, 3).
-    cv::cvtColor(imgDepth, imgDepth, cv::COLOR_GRAY2RGB);
-    putText(imgDepth, "Depth", Point(5, 15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 255, 0), 2);
-    putText(imgOut, "Output", Point(5, 15), FONT_HERSHEY_SIMPLEX, 0.5, Scalar(0, 0, 0), 2);
-    app.renderMats({ imgColor, imgOut, imgDepth }, RenderType::RENDER_ONE_ROW);
+// Present whatever is finished on every camera without waiting. Return false if nothing was.
+template <typename Present>
+static bool PresentReady(Cameras& cameras, Present present)
+{
+    bool presented = false;
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+        FrameSlot* slot = cameras[i]->Pipeline().WaitPresent(0ms);
+        if (!slot) continue;
+        present(i, slot);
+        presented = true;
+    }
+    return presented;
 }
 
-int main() try
+static void OnQuitSignal(int)
 {
-    //创建一个Pipeline，Pipeline是整个高级API的入口，通过Pipeline可以很容易的打开和关闭
-    //多种类型的流并获取一组帧数据
-    ob::Pipeline pipe;
+    gQuitApp = true;
+}
+
+// Each camera gets its own sink. With several, the index tells them apart.
+static std::string SinkFor(const std::string& sink, const size_t index, const size_t numCameras)
+{
+    if (numCameras == 1 || sink == "null") return sink;
+    return sink + "-" + std::to_string(index);
+}
 
-    //获取彩色相机的所有流配置，包括流的分辨率，帧率，以及帧的格式
-    auto colorProfiles = pipe.getStreamProfileList(OB_SENSOR_COLOR);
+// The pool gets the cores not taken by the convert thread of each camera and the present thread.
+static unsigned PoolSize(const int requested, const size_t numCameras)
+{
+    if (requested > 0) return static_cast<unsigned>(requested);
+    const unsigned cores = std::thread::hardware_concurrency();
+    const unsigned reserved = static_cast<unsigned>(numCameras) + 1;
+    return std::max(MIN_WORKERS, cores > reserved ? cores - reserved : 0U);
+}
 
-    //通过接口设置感兴趣项，返回对应Profile列表的首个Profile
-    auto colorProfile = colorProfiles->getVideoStreamProfile(W, H, OB_FORMAT_RGB888, 30);
-    if (!colorProfile) {
-        colorProfile = colorProfiles->getProfile(0)->as<ob::VideoStreamProfile>();
+int main(int argc, char* argv[]) try
+{
+    // Before any Mat is allocated.
+    const FramePool& framePool = InstallFramePool();
+    const Options options = ParseOptions(argc, argv);
+    if (options.help) {
+        std::cout << USAGE;
+        return 0;
+    }
+    ConfigureThreads(options.placement);
+    if (options.cvThreads > 0) setNumThreads(options.cvThreads);
+    if (!options.benchmark.empty()) {
+        RunBenchmark(options, std::cout);
+        return 0;
     }
 
-    //获取深度相机的所有流配置，包括流的分辨率，帧率，以及帧的格式
-    auto depthProfiles = pipe.getStreamProfileList(OB_SENSOR_DEPTH);
+    // Every connected camera, up to --cameras.
+    ob::Context context;
+    const auto deviceList = context.queryDeviceList();
+    size_t numCameras = deviceList->deviceCount();
+    if (options.maxCameras > 0) numCameras = std::min(numCameras, static_cast<size_t>(options.maxCameras));
+    if (numCameras == 0) throw std::runtime_error("No camera found.");
 
-    //通过接口设置感兴趣项，返回对应Profile列表的首个Profile
-    auto depthProfile = depthProfiles->getVideoStreamProfile(W, H, OB_FORMAT_Y16, 30);
-    if (!depthProfile) {
-        depthProfile = depthProfiles->getProfile(0)->as<ob::VideoStreamProfile>();
+    // Open the sinks first. A bad sink should fail before the cameras start.
+    std::vector<std::unique_ptr<OutputSink>> sinks;
+    if (options.headless) {
+        for (size_t i = 0; i < numCameras; i++) sinks.push_back(MakeOutputSink(SinkFor(options.sink, i, numCameras)));
     }
 
-    //通过创建Config来配置Pipeline要启用或者禁用哪些流，这里将启用彩色流和深度流
-    std::shared_ptr<ob::Config> config = std::make_shared<ob::Config>();
-    config->enableStream(colorProfile);
-    config->enableStream(depthProfile);
+    // Load and warm up one face detector per camera while the cameras start.
+    std::vector<std::future<std::unique_ptr<FaceDetection>>> futureFaceDets;
+    for (size_t i = 0; i < numCameras; i++)
+    {
+        futureFaceDets.push_back(std::async(std::launch::async, [runs = options.warmUpRuns] {
+            auto faceDet = std::make_unique<FaceDetection>(W, H);
+            faceDet->WarmUp(runs);
+            return faceDet;
+        }));
+    }
 
-    // 配置对齐模式为软件D2C对齐
-    config->setAlignMode(ALIGN_D2C_SW_MODE);
+    // Declared before the cameras. Their stages are taken off the pool before it stops.
+    WorkerPool pool(PoolSize(options.workers, numCameras));
+    Cameras cameras;
+    for (size_t i = 0; i < numCameras; i++)
+    {
+        cameras.push_back(std::make_unique<CameraSession>(deviceList->getDevice(static_cast<uint32_t>(i)),
+            deviceList->serialNumber(static_cast<uint32_t>(i)), options.budgetMs));
+        cameras.back()->Start(CAPTURE_BACKEND, options.pairing, options.color);
+    }
+    // Without a composite, a background would only be decoded for nothing.
+    const bool composites = !options.headless || options.output == OutputLayout::COMPOSITE;
+    const BackgroundSettings background = composites ? options.background : BackgroundSettings{};
+    for (size_t i = 0; i < numCameras; i++)
+    {
+        cameras[i]->StartProcessing(futureFaceDets[i].get(), pool, background);   // Rethrows if the model failed to load.
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - gStartTime);
+    std::cout << "Startup: " << numCameras << " camera(s) and " << pool.Size() << " workers ready in "
+        << elapsed.count() << " ms" << std::endl;
 
-    //启动在Config中配置的流，如果不传参数，将启动默认配置启动流
-    pipe.start(config);
+    // Last, so the threads started above do not inherit the present cores.
+    EnterRole(ThreadRole::PRESENT);
 
-    std::jthread waitFramesThread([&]() {
-        while (!gQuitApp) {
-            //以阻塞的方式等待一帧数据，该帧是一个复合帧，里面包含配置里启用的所有流的帧数据，
-            //并设置帧的等待超时时间为100ms
-            auto frameSet = pipe.waitForFrames(100);
-            if (!frameSet) continue;
-            std::unique_lock<std::mutex> lock(gMutexFrames, std::defer_lock);
-            if (lock.try_lock()) {
-                gSpFrameSet = frameSet;
-            }
-        }});
+    AllocationCheck allocationCheck(framePool);
+    const auto presentedSoFar = [&cameras] {
+        uint64_t presented = 0;
+        for (const auto& camera : cameras) presented += camera->Presented();
+        return presented;
+    };
 
     TickMeter tm;
-    FaceDetection faceDet(W, H);
-    HumanObjectTracker hoTracker;
-    //创建一个用于渲染的窗口，并设置窗口的分辨率
-    Window app(WINDOW_TITLE, colorProfile->width() * 3, colorProfile->height());
-
-    // Forever loop.
-    while (app) {
-        ProcessAndDisplayFrameSet(app, hoTracker, faceDet, tm);
-        if (app.ScanKeyPress()) break;
+    tm.start();
+    if (options.headless) {
+        // No window system code at all. Stop on Ctrl+C or SIGTERM.
+        for (auto& camera : cameras)
+        {
+            camera->Pipeline().SetPreview(false);
+            camera->Pipeline().SetYuvOutput(options.yuvOut);
+            camera->Pipeline().SetMatteOutput(options.output != OutputLayout::COMPOSITE);
+        }
+        std::signal(SIGINT, OnQuitSignal);
+        std::signal(SIGTERM, OnQuitSignal);
+        while (!gQuitApp) {
+            // Read the generation first, so a frame finished meanwhile cuts the sleep short.
+            const uint64_t generation = pool.Generation();
+            const bool presented = PresentReady(cameras, [&](const size_t i, FrameSlot* slot) {
+                WriteFrame(*cameras[i], slot, *sinks[i], options.output); });
+            if (!presented) pool.WaitProgress(generation, HEADLESS_POLL_INTERVAL);
+            else allocationCheck.Update(presentedSoFar());
+        }
     }
+    else {
+        //创建用于渲染的窗口，每个相机一个，并设置窗口的分辨率
+        std::vector<Window> windows;
+        for (const auto& camera : cameras)
+        {
+            const std::string title = numCameras == 1 ? WINDOW_TITLE : WINDOW_TITLE + " - " + camera->Serial();
+            windows.emplace_back(title, camera->Width() * 3, camera->Height());
+        }
 
-    gQuitApp = true;
-    waitFramesThread.join();
-    pipe.stop();
+        // Forever loop. Sleeps until a frame is ready, waking up at least every UI_POLL_INTERVAL for UI events.
+        // Press L to print the latency statistics.
+        Window& app = windows.front();
+        while (app) {
+            const uint64_t generation = pool.Generation();
+            const bool presented = PresentReady(cameras, [&](const size_t i, FrameSlot* slot) {
+                DisplayFrame(windows[i], *cameras[i], slot); });
+            if (!presented) pool.WaitProgress(generation, UI_POLL_INTERVAL);
+            else allocationCheck.Update(presentedSoFar());
+            if (app.ScanKeyPress()) break;
+            if (app.getKey() == 'L' || app.getKey() == 'l') {
+                for (const auto& camera : cameras) camera->Stats().Report(std::cout);
+            }
+        }
+    }
+    tm.stop();
+
+    uint64_t presented = 0;
+    for (auto& camera : cameras)
+    {
+        camera->Stop();
+        presented += camera->Presented();
+    }
+    for (const auto& camera : cameras) camera->Report(std::cout);
+    std::cout << "All cameras: " << presented << " frames in " << tm.getTimeSec() << " s, "
+        << presented / tm.getTimeSec() << " frames/s" << std::endl;
+    allocationCheck.Report(std::cout, presented);
     return 0;
 }
 catch (const ob::Error& e)
@@ -150,3 +309,13 @@ catch (const ob::Error& e)
         << "\nType:" << e.getExceptionType() << std::endl;
     exit(EXIT_FAILURE);
 }
+catch (const std::invalid_argument& e)
+{
+    std::cerr << e.what() << "\n" << USAGE;
+    exit(EXIT_FAILURE);
+}
+catch (const std::exception& e)
+{
+    std::cerr << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+}
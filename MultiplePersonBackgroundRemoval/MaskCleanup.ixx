@@ -0,0 +1,282 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/core.hpp>
+#include "simd.hpp"
+
+// Interface
+export module MaskCleanup;
+
+using namespace cv;
+
+// Removes the specks and thin leaks of the flood mask and fills its holes, e.g. ToF dropouts on hair and dark
+// fabric. Works on the mask packed to one bit per pixel, 64 pixels per word: every step is a few word-wide shifts,
+// ANDs and ORs per word, so the whole cleanup costs a small part of one 8-bit morphology pass.
+export class MaskCleanup
+{
+private:
+    static constexpr int OPEN_RADIUS = 1;    // Open with a 3 x 3 square. Removes specks and leaks up to 2 pixels wide.
+    static constexpr int CLOSE_RADIUS = 2;   // Close with a 5 x 5 square. Joins parts split by cracks up to 4 pixels.
+
+    // Pixel x of a row is bit x % 64 of word x / 64. The bits after the last pixel are always 0.
+    int mRows = 0, mCols = 0, mWords = 0;
+    uint64_t mTailMask = 0;                   // Valid bits of the last word of a row.
+    std::vector<uint64_t> mBits, mTemp, mReach;
+
+    uint64_t* Row(std::vector<uint64_t>& bits, const int y) { return bits.data() + static_cast<size_t>(y) * mWords; }
+    void Pack(const Mat& imgMask);
+    void Unpack(Mat& imgMask) const;
+    // A (2 * radius + 1) square. Erosion sees ones outside the frame, dilation zeros.
+    void Dilate(const int radius);
+    void Erode(const int radius);
+    // Holes are the background not connected to the frame border. Flood the background from the border and keep
+    // everything it does not reach.
+    void FillHoles();
+
+public:
+    // imgMask: 0 and 255, cleaned in place.
+    void Clean(Mat& imgMask);
+};
+
+module: private;
+
+void MaskCleanup::Clean(Mat& imgMask)
+{
+    CV_Assert(imgMask.type() == CV_8UC1);
+    Pack(imgMask);
+    Erode(OPEN_RADIUS);
+    Dilate(OPEN_RADIUS);
+    Dilate(CLOSE_RADIUS);
+    Erode(CLOSE_RADIUS);
+    FillHoles();
+    Unpack(imgMask);
+}
+
+void MaskCleanup::Pack(const Mat& imgMask)
+{
+    mRows = imgMask.rows;
+    mCols = imgMask.cols;
+    mWords = (mCols + 63) / 64;
+    mTailMask = mCols % 64 ? (uint64_t{ 1 } << (mCols % 64)) - 1 : ~uint64_t{ 0 };
+    const size_t total = static_cast<size_t>(mRows) * mWords;
+    mBits.assign(total, 0);   // No allocation once the vectors have grown.
+    mTemp.resize(total);
+    mReach.resize(total);
+
+    for (int y = 0; y < mRows; y++)
+    {
+        const uint8_t* mask = imgMask.ptr<uint8_t>(y);
+        uint64_t* bits = Row(mBits, y);
+        int x = 0;
+#ifdef SIMD_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= mCols; x += 16)
+        {
+            const int empty = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + x)), zero));
+            bits[x >> 6] |= static_cast<uint64_t>(~empty & 0xFFFF) << (x & 63);
+        }
+#endif
+        for (; x < mCols; x++)
+        {
+            if (mask[x]) bits[x >> 6] |= uint64_t{ 1 } << (x & 63);
+        }
+    }
+}
+
+// Eight mask bytes for each byte of bits.
+static const std::array<uint64_t, 256> BYTE_EXPAND = [] {
+    std::array<uint64_t, 256> table{};
+    for (int i = 0; i < 256; i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            if (i & (1 << bit)) table[i] |= uint64_t{ 0xFF } << (bit * 8);
+        }
+    }
+    return table;
+}();
+
+void MaskCleanup::Unpack(Mat& imgMask) const
+{
+    for (int y = 0; y < mRows; y++)
+    {
+        const uint64_t* bits = mBits.data() + static_cast<size_t>(y) * mWords;
+        uint8_t* mask = imgMask.ptr<uint8_t>(y);
+        int x = 0;
+        for (; x + 8 <= mCols; x += 8)
+        {
+            const uint64_t bytes = BYTE_EXPAND[(bits[x >> 6] >> (x & 63)) & 0xFF];
+            std::memcpy(mask + x, &bytes, 8);
+        }
+        for (; x < mCols; x++)
+        {
+            mask[x] = (bits[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+        }
+    }
+}
+
+// Row shifted by k pixels to the right (to higher x) or left, filling with outside. 0 < k < 64.
+static inline uint64_t ShiftRight(const uint64_t* row, const int w, const int k, const uint64_t outside)
+{
+    return (row[w] << k) | ((w > 0 ? row[w - 1] : outside) >> (64 - k));
+}
+
+static inline uint64_t ShiftLeft(const uint64_t* row, const int w, const int words, const int k, const uint64_t outside)
+{
+    return (row[w] >> k) | ((w + 1 < words ? row[w + 1] : outside) << (64 - k));
+}
+
+void MaskCleanup::Dilate(const int radius)
+{
+    // Horizontal into mTemp, vertical back into mBits. Separable like the square.
+    for (int y = 0; y < mRows; y++)
+    {
+        const uint64_t* row = Row(mBits, y);
+        uint64_t* out = Row(mTemp, y);
+        for (int w = 0; w < mWords; w++)
+        {
+            uint64_t bits = row[w];
+            for (int k = 1; k <= radius; k++) bits |= ShiftRight(row, w, k, 0) | ShiftLeft(row, w, mWords, k, 0);
+            out[w] = bits;
+        }
+        out[mWords - 1] &= mTailMask;
+    }
+    for (int y = 0; y < mRows; y++)
+    {
+        uint64_t* out = Row(mBits, y);
+        const int y0 = std::max(y - radius, 0), y1 = std::min(y + radius, mRows - 1);
+        for (int w = 0; w < mWords; w++)
+        {
+            uint64_t bits = 0;
+            for (int i = y0; i <= y1; i++) bits |= mTemp[static_cast<size_t>(i) * mWords + w];
+            out[w] = bits;
+        }
+    }
+}
+
+void MaskCleanup::Erode(const int radius)
+{
+    const uint64_t ones = ~uint64_t{ 0 };
+    for (int y = 0; y < mRows; y++)
+    {
+        uint64_t* row = Row(mBits, y);
+        uint64_t* out = Row(mTemp, y);
+        row[mWords - 1] |= ~mTailMask;   // Beyond the last pixel is outside the frame too.
+        for (int w = 0; w < mWords; w++)
+        {
+            uint64_t bits = row[w];
+            for (int k = 1; k <= radius; k++) bits &= ShiftRight(row, w, k, ones) & ShiftLeft(row, w, mWords, k, ones);
+            out[w] = bits;
+        }
+        out[mWords - 1] &= mTailMask;
+    }
+    for (int y = 0; y < mRows; y++)
+    {
+        uint64_t* out = Row(mBits, y);
+        const int y0 = std::max(y - radius, 0), y1 = std::min(y + radius, mRows - 1);
+        for (int w = 0; w < mWords; w++)
+        {
+            uint64_t bits = ones;
+            for (int i = y0; i <= y1; i++) bits &= mTemp[static_cast<size_t>(i) * mWords + w];
+            out[w] = bits;
+        }
+    }
+}
+
+// Spread the set bits of reach through the runs of open they touch, along the row and across words.
+// Kogge-Stone fill: each doubling step moves the front twice as far, 6 steps cover a word.
+static bool FillRow(uint64_t* reach, const uint64_t* open, const int words)
+{
+    bool changed = false;
+    uint64_t carry = 0;
+    for (int w = 0; w < words; w++)   // To higher x.
+    {
+        uint64_t g = (reach[w] | carry) & open[w];
+        uint64_t p = open[w];
+        g |= p & (g << 1); p &= p << 1;
+        g |= p & (g << 2); p &= p << 2;
+        g |= p & (g << 4); p &= p << 4;
+        g |= p & (g << 8); p &= p << 8;
+        g |= p & (g << 16); p &= p << 16;
+        g |= p & (g << 32);
+        changed |= g != reach[w];
+        reach[w] = g;
+        carry = g >> 63;
+    }
+    carry = 0;
+    for (int w = words - 1; w >= 0; w--)   // To lower x.
+    {
+        uint64_t g = (reach[w] | carry) & open[w];
+        uint64_t p = open[w];
+        g |= p & (g >> 1); p &= p >> 1;
+        g |= p & (g >> 2); p &= p >> 2;
+        g |= p & (g >> 4); p &= p >> 4;
+        g |= p & (g >> 8); p &= p >> 8;
+        g |= p & (g >> 16); p &= p >> 16;
+        g |= p & (g >> 32);
+        changed |= g != reach[w];
+        reach[w] = g;
+        carry = g << 63;
+    }
+    return changed;
+}
+
+void MaskCleanup::FillHoles()
+{
+    // mTemp: the background, the inverted mask. mReach: the part of it flooded from the border so far.
+    for (int y = 0; y < mRows; y++)
+    {
+        const uint64_t* row = Row(mBits, y);
+        uint64_t* open = Row(mTemp, y);
+        uint64_t* reach = Row(mReach, y);
+        for (int w = 0; w < mWords; w++)
+        {
+            open[w] = ~row[w];
+            reach[w] = 0;
+        }
+        open[mWords - 1] &= mTailMask;
+        if (y == 0 || y == mRows - 1) std::memcpy(reach, open, mWords * sizeof(uint64_t));
+        reach[0] |= open[0] & 1;
+        reach[mWords - 1] |= open[mWords - 1] & (uint64_t{ 1 } << ((mCols - 1) & 63));
+    }
+
+    // Down and up sweeps, each row taking what the row before reached, until nothing moves. Background that winds
+    // back up or down takes another round trip. Person shapes settle in two or three. A row is filled along only
+    // when something new came in, so the last sweeps are little more than the ORs.
+    for (int y = 0; y < mRows; y++) FillRow(Row(mReach, y), Row(mTemp, y), mWords);
+    const auto spread = [this](const int y, const int from) {
+        uint64_t* reach = Row(mReach, y);
+        const uint64_t* open = Row(mTemp, y);
+        const uint64_t* next = Row(mReach, from);
+        bool changed = false;
+        for (int w = 0; w < mWords; w++)
+        {
+            const uint64_t grown = reach[w] | (next[w] & open[w]);
+            changed |= grown != reach[w];
+            reach[w] = grown;
+        }
+        if (changed) FillRow(reach, open, mWords);
+        return changed;
+    };
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (int y = 1; y < mRows; y++) changed |= spread(y, y - 1);
+        for (int y = mRows - 2; y >= 0; y--) changed |= spread(y, y + 1);
+    }
+
+    // Person is whatever the border flood did not reach.
+    for (int y = 0; y < mRows; y++)
+    {
+        uint64_t* row = Row(mBits, y);
+        const uint64_t* reach = Row(mReach, y);
+        for (int w = 0; w < mWords; w++) row[w] = ~reach[w];
+        row[mWords - 1] &= mTailMask;
+    }
+}
@@ -0,0 +1,129 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <cstdint>
+#include <algorithm>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+
+// Interface
+export module MaskRefiner;
+
+using namespace cv;
+
+// Turns the blocky mask from depth into an alpha matte that follows the edges of the color image.
+// A guided filter (He et al.) with the luma as guide: box means from integral images, O(1) per pixel whatever the
+// radius. Only a band around the contour is filtered. Inside and outside of it the mask is kept as it is.
+export class MaskRefiner
+{
+private:
+    static constexpr int BAND = 8;          // Pixels on each side of the contour that may change. ToF edge error.
+    static constexpr int RADIUS = 8;        // Window radius of the filter.
+    static constexpr double EPS = 1e-3;     // Regularization for a guide in 0..1. Larger is smoother, less edge following.
+
+    Mat mImgBand;                           // Pixels to filter.
+    Mat mImgCoefBand;                       // Pixels whose coefficients the band needs. Band grown by RADIUS.
+    Mat mImgGray, mImgI, mImgP, mImgIP;     // Guide, mask and their product, 0..1, over the work rectangle.
+    Mat mSumI, mSumII, mSumP, mSumIP;       // Their integral images.
+    Mat mImgA, mImgB, mSumA, mSumB;         // Linear coefficients per pixel and their integral images.
+
+public:
+    // imgGuide: 8-bit luma, or BGR color (RGB if rgb), the size of imgMask. imgMask: 0 and 255.
+    // imgAlpha: 0 to 255. The mask, with the band around its contour replaced by the filtered matte.
+    void Refine(const Mat& imgGuide, const bool rgb, const Mat& imgMask, Mat& imgAlpha);
+};
+
+module: private;
+
+// A filter window clipped to the work rectangle. Integral image coordinates, [x0, x1) x [y0, y1).
+struct Window
+{
+    int x0, y0, x1, y1;
+
+    Window(const int x, const int y, const int radius, const Size& size)
+        : x0(std::max(x - radius, 0)), y0(std::max(y - radius, 0)),
+          x1(std::min(x + radius + 1, size.width)), y1(std::min(y + radius + 1, size.height)) {}
+
+    double Area() const { return static_cast<double>(x1 - x0) * (y1 - y0); }
+
+    double Mean(const Mat& sum) const
+    {
+        const double* top = sum.ptr<double>(y0);
+        const double* bottom = sum.ptr<double>(y1);
+        return (bottom[x1] - bottom[x0] - top[x1] + top[x0]) / Area();
+    }
+};
+
+void MaskRefiner::Refine(const Mat& imgGuide, const bool rgb, const Mat& imgMask, Mat& imgAlpha)
+{
+    CV_Assert(imgMask.type() == CV_8UC1 && imgGuide.size() == imgMask.size() && imgGuide.depth() == CV_8U);
+    imgMask.copyTo(imgAlpha);
+
+    // The band is the morphological gradient: dilated minus eroded.
+    static const Mat bandKernel = getStructuringElement(MORPH_RECT, Size(2 * BAND + 1, 2 * BAND + 1));
+    static const Mat radiusKernel = getStructuringElement(MORPH_RECT, Size(2 * RADIUS + 1, 2 * RADIUS + 1));
+    morphologyEx(imgMask, mImgBand, MORPH_GRADIENT, bandKernel);
+    const Rect bandRect = boundingRect(mImgBand);
+    if (bandRect.empty()) return;
+
+    // A band pixel averages the coefficients within RADIUS, and each coefficient the statistics within RADIUS.
+    const Rect rect = Rect(bandRect.x - 2 * RADIUS, bandRect.y - 2 * RADIUS, bandRect.width + 4 * RADIUS,
+        bandRect.height + 4 * RADIUS) & Rect(Point(), imgMask.size());
+    if (imgGuide.channels() == 1) imgGuide(rect).convertTo(mImgI, CV_32F, 1.0 / 255);
+    else {
+        cvtColor(imgGuide(rect), mImgGray, rgb ? COLOR_RGB2GRAY : COLOR_BGR2GRAY);
+        mImgGray.convertTo(mImgI, CV_32F, 1.0 / 255);
+    }
+    imgMask(rect).convertTo(mImgP, CV_32F, 1.0 / 255);
+    multiply(mImgI, mImgP, mImgIP);
+    // Double sums. Float loses the small differences of large sums.
+    integral(mImgI, mSumI, mSumII, CV_64F, CV_64F);
+    integral(mImgP, mSumP, CV_64F);
+    integral(mImgIP, mSumIP, CV_64F);
+    dilate(mImgBand(rect), mImgCoefBand, radiusKernel);
+
+    // q = a * I + b, fitted to the mask in each window.
+    mImgA.create(rect.size(), CV_32F);
+    mImgB.create(rect.size(), CV_32F);
+    parallel_for_(Range(0, rect.height), [&](const Range& rows) {
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const uint8_t* need = mImgCoefBand.ptr<uint8_t>(y);
+            float* a = mImgA.ptr<float>(y);
+            float* b = mImgB.ptr<float>(y);
+            for (int x = 0; x < rect.width; x++)
+            {
+                if (!need[x]) {
+                    a[x] = b[x] = 0;
+                    continue;
+                }
+                const Window window(x, y, RADIUS, rect.size());
+                const double meanI = window.Mean(mSumI);
+                const double meanP = window.Mean(mSumP);
+                const double varI = window.Mean(mSumII) - meanI * meanI;
+                const double covIP = window.Mean(mSumIP) - meanI * meanP;
+                const double slope = covIP / (varI + EPS);
+                a[x] = static_cast<float>(slope);
+                b[x] = static_cast<float>(meanP - slope * meanI);
+            }
+        }
+    });
+    integral(mImgA, mSumA, CV_64F);
+    integral(mImgB, mSumB, CV_64F);
+
+    // Average the coefficients of all windows over each band pixel.
+    parallel_for_(Range(0, rect.height), [&](const Range& rows) {
+        for (int y = rows.start; y < rows.end; y++)
+        {
+            const uint8_t* band = mImgBand.ptr<uint8_t>(rect.y + y) + rect.x;
+            const float* guide = mImgI.ptr<float>(y);
+            uint8_t* alpha = imgAlpha.ptr<uint8_t>(rect.y + y) + rect.x;
+            for (int x = 0; x < rect.width; x++)
+            {
+                if (!band[x]) continue;
+                const Window window(x, y, RADIUS, rect.size());
+                alpha[x] = saturate_cast<uint8_t>((window.Mean(mSumA) * guide[x] + window.Mean(mSumB)) * 255);
+            }
+        }
+    });
+}
@@ -0,0 +1,56 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/core.hpp>
+#include <turbojpeg.h>   // libjpeg-turbo. vcpkg installs it with opencv4[jpeg].
+
+// Interface
+export module MjpegDecoder;
+
+using namespace cv;
+
+// A persistent libjpeg-turbo decoder. Unlike imdecode, the decoder context lives as long as the object and the
+// output goes into the caller's buffer, which is reused while the shape stays the same.
+// Scaled decodes skip most of the inverse DCT work: 1/8 is just the DC coefficients.
+// Not thread safe. One per thread or per stage.
+export class MjpegDecoder
+{
+private:
+    tjhandle mHandle;
+
+public:
+    MjpegDecoder() : mHandle(tjInitDecompress()) {
+        if (!mHandle) throw std::runtime_error(std::string("Cannot create a JPEG decoder: ") + tjGetErrorStr2(nullptr));
+    }
+    ~MjpegDecoder() { tjDestroy(mHandle); }
+    MjpegDecoder(const MjpegDecoder&) = delete;
+    MjpegDecoder& operator=(const MjpegDecoder&) = delete;
+
+    // Size of a decode at 1/scaleDenom. scaleDenom is 1, 2, 4 or 8.
+    static Size ScaledSize(const Size& size, const int scaleDenom) {
+        const tjscalingfactor factor{ 1, scaleDenom };
+        return Size(TJSCALED(size.width, factor), TJSCALED(size.height, factor));
+    }
+
+    // Decode a JPEG image to BGR, or RGB if rgb, at 1/scaleDenom of its size. Return false if it is corrupt.
+    bool Decode(const uint8_t* data, const size_t size, Mat& img, const int scaleDenom = 1, const bool rgb = false);
+};
+
+module: private;
+
+bool MjpegDecoder::Decode(const uint8_t* data, const size_t size, Mat& img, const int scaleDenom, const bool rgb)
+{
+    int width = 0, height = 0, subsampling = 0, colorspace = 0;
+    const auto jpegSize = static_cast<unsigned long>(size);
+    if (tjDecompressHeader3(mHandle, data, jpegSize, &width, &height, &subsampling, &colorspace) != 0) return false;
+
+    img.create(ScaledSize(Size(width, height), scaleDenom), CV_8UC3);
+    const int result = tjDecompress2(mHandle, data, jpegSize, img.data, img.cols, static_cast<int>(img.step), img.rows,
+        rgb ? TJPF_RGB : TJPF_BGR, 0);
+    // Warnings, e.g. a few bytes of padding after the image, still leave a good image.
+    return result == 0 || tjGetErrorCode(mHandle) == TJERR_WARNING;
+}
@@ -0,0 +1,81 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+
+// Interface
+export module MotionGate;
+
+using namespace cv;
+
+constexpr int THUMB_SCALE = 8;    // Changes are detected on 1/8 thumbnails.
+// Mean absolute difference per thumbnail pixel. Two thresholds for hysteresis, so sensor noise
+// does not toggle the scene between static and changed.
+constexpr double LUMA_ENTER_STATIC = 1.5;    // Gray levels.
+constexpr double LUMA_LEAVE_STATIC = 3.0;
+constexpr double DEPTH_ENTER_STATIC = 0.5;   // Depth units, n*16mm.
+constexpr double DEPTH_LEAVE_STATIC = 1.0;
+constexpr int MAX_REUSE_AGE = 30;            // Frames. Fully process at least once a second anyway.
+
+// Cheap change detector. Tells if the previous face list and mask are still good for the current frame.
+export class MotionGate
+{
+private:
+    Mat mImgThumbColor;
+    Mat mImgLuma, mImgLumaRef;     // Current and reference (last fully processed frame) luma thumbnails.
+    Mat mImgDepth, mImgDepthRef;   // Current and reference depth thumbnails.
+    bool mStatic = false;
+    int mReuseAge = 0;
+
+public:
+    // Return true if the previous results can be reused for this frame. imgColor is RGB if rgb, BGR, or already
+    // luma if it has one channel. imgDepthThumb: the depth thumbnail from ConvertDepth. imgColor may be a thumbnail of the same size already.
+    bool CanReuse(const Mat& imgColor, const bool rgb, const Mat& imgDepthThumb);
+};
+
+module: private;
+
+bool MotionGate::CanReuse(const Mat& imgColor, const bool rgb, const Mat& imgDepthThumb)
+{
+    // Downscale first, then convert to gray on the thumbnail only.
+    const bool isThumb = imgColor.size() == imgDepthThumb.size();
+    const Size thumbSize(imgColor.cols / THUMB_SCALE, imgColor.rows / THUMB_SCALE);
+    if (imgColor.channels() == 1) {
+        if (isThumb) imgColor.copyTo(mImgLuma);
+        else resize(imgColor, mImgLuma, thumbSize, 0, 0, INTER_AREA);
+    }
+    else {
+        if (!isThumb) resize(imgColor, mImgThumbColor, thumbSize, 0, 0, INTER_AREA);
+        cvtColor(isThumb ? imgColor : mImgThumbColor, mImgLuma, rgb ? COLOR_RGB2GRAY : COLOR_BGR2GRAY);
+    }
+    imgDepthThumb.copyTo(mImgDepth);   // Kept as the reference. The slot's thumbnail is recycled.
+
+    if (mImgLumaRef.empty())
+    {
+        mImgLuma.copyTo(mImgLumaRef);
+        mImgDepth.copyTo(mImgDepthRef);
+        return false;
+    }
+
+    // Sum of absolute differences against the reference. cv::norm is vectorized.
+    const double lumaSad = norm(mImgLuma, mImgLumaRef, NORM_L1) / static_cast<double>(mImgLuma.total());
+    const double depthSad = norm(mImgDepth, mImgDepthRef, NORM_L1) / static_cast<double>(mImgDepth.total());
+
+    if (mStatic)
+        mStatic = lumaSad <= LUMA_LEAVE_STATIC && depthSad <= DEPTH_LEAVE_STATIC;
+    else
+        mStatic = lumaSad <= LUMA_ENTER_STATIC && depthSad <= DEPTH_ENTER_STATIC;
+
+    if (mStatic && mReuseAge < MAX_REUSE_AGE)
+    {
+        mReuseAge++;
+        return true;
+    }
+
+    // Fully processed. This frame becomes the new reference.
+    mReuseAge = 0;
+    std::swap(mImgLuma, mImgLumaRef);
+    std::swap(mImgDepth, mImgDepthRef);
+    return false;
+}
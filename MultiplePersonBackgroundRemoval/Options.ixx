@@ -0,0 +1,170 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <string>
+#include <stdexcept>
+
+// Interface
+export module Options;
+
+import ThreadAffinity;
+import FramePairing;
+import Background;
+import OutputSink;
+
+// Color stream format asked from the camera.
+export enum class ColorFormat { RGB888, MJPG, NV12, NV21, I420, YUYV, UYVY };
+
+// Command line options.
+export struct Options
+{
+    bool headless = false;        // No window. Output goes to the sink.
+    std::string sink = "null";    // null | file:<path> | pipe:<path> | shm:<name>
+    int maxCameras = 0;           // 0: all connected cameras.
+    int workers = 0;              // Shared worker pool size. 0: from the core count.
+    int budgetMs = 33;            // Work per frame. Quality is lowered above and raised again well below.
+    int warmUpRuns = 3;           // Face detector runs on a synthetic frame at startup.
+    ThreadPlacement placement;    // Cores per thread role.
+    int cvThreads = 0;            // OpenCV internal threads. 0: OpenCV default.
+    PairingSettings pairing;      // How color and depth frames are paired.
+    ColorFormat color = ColorFormat::RGB888;   // MJPG and YUV take less USB bandwidth than RGB888.
+    bool yuvOut = false;          // Headless with YUV color: composite and write YUV, no BGR conversion.
+    BackgroundSettings background;   // What goes behind the persons.
+    OutputLayout output = OutputLayout::COMPOSITE;   // Headless: the composite, or color and matte to composite downstream.
+    std::string benchmark;        // Run this benchmark instead of the cameras.
+    bool help = false;
+};
+
+export const char* USAGE =
+    "Usage: MultiplePersonBackgroundRemoval [options]\n"
+    "  --headless          Run without a window. Stop with Ctrl+C or SIGTERM.\n"
+    "  --sink <sink>       Where headless output goes:\n"
+    "                        null           Discard. For benchmarks. (default)\n"
+    "                        file:<path>    Write raw frames to a file, replacing it.\n"
+    "                        pipe:<path>    Write raw frames to a named pipe.\n"
+    "                        shm:<name>     Publish the latest frame in shared memory.\n"
+    "                      With several cameras, -<index> is appended to the path or name.\n"
+    "  --cameras <n>       Use at most n of the connected cameras. (default: all)\n"
+    "  --workers <n>       Worker threads shared by all cameras. (default: from the core count)\n"
+    "  --budget <ms>       Processing time per frame to hold by lowering quality. (default: 33)\n"
+    "  --warm-up <n>       Face detector runs on a synthetic frame before the first frame. (default: 3)\n"
+    "  --pin <role>=<cpus> Pin a thread role to cores, e.g. capture=2 or workers=4-7.\n"
+    "                      Roles: capture, convert, workers, present. Repeat for each role.\n"
+    "  --rt-capture        Run the capture threads at real-time priority.\n"
+    "  --cv-threads <n>    Cap the threads OpenCV uses inside each call.\n"
+    "  --pairing <mode>    How color and depth frames are paired:\n"
+    "                        sdk            SDK frame sync and software D2C. (default)\n"
+    "                        timestamp      By device timestamp, with hardware D2C if available.\n"
+    "  --pair-tolerance <ms>  Largest color/depth timestamp difference of a pair. (default: 16)\n"
+    "  --depth-only        With timestamp pairing, go on with depth alone when color lags.\n"
+    "  --color <format>    Color stream format: rgb (default), mjpg, nv12, nv21, i420, yuyv or uyvy.\n"
+    "  --yuv-out           With --headless and a YUV color format, write the output in that format.\n"
+    "  --output <layout>   What headless frames are made of:\n"
+    "                        composite      The persons over the background. (default)\n"
+    "                        bgra           BGRA, the mask or soft edged matte in alpha.\n"
+    "                        planes         The BGR rows, then the 8-bit mask or matte rows.\n"
+    "  --background <bg>   What goes behind the persons:\n"
+    "                        green          Flat green screen color. (default)\n"
+    "                        image:<path>   A picture, scaled and cropped to the frame.\n"
+    "                        video:<path>   A video, looped, one video frame per camera frame.\n"
+    "                        blur           The live frame, blurred.\n"
+    "  --benchmark <name>  Run a benchmark and exit:\n"
+    "                        jitter         Capture thread wake-up lateness, pinned and unpinned.\n"
+    "                        pairing        SDK frame sync against timestamp pairing. Needs a camera.\n"
+    "                        depth          Fused depth kernel against the OpenCV calls it replaces.\n"
+    "                        composite      Select kernel against setTo and copyTo, per mask and background.\n"
+    "                        cleanup        Bit packed mask cleanup against OpenCV morphology.\n"
+    "                        background     Each background mode with its composite at 1080p.\n"
+    "  --help              Show this help.\n";
+
+int ParseCount(const std::string& arg, const std::string& value)
+{
+    size_t end = 0;
+    int count = 0;
+    try { count = std::stoi(value, &end); }
+    catch (const std::exception&) { end = 0; }
+    if (end != value.size() || count < 1) throw std::invalid_argument("Expected a positive number for " + arg);
+    return count;
+}
+
+ColorFormat ParseColorFormat(const std::string& value)
+{
+    if (value == "rgb") return ColorFormat::RGB888;
+    if (value == "mjpg") return ColorFormat::MJPG;
+    if (value == "nv12") return ColorFormat::NV12;
+    if (value == "nv21") return ColorFormat::NV21;
+    if (value == "i420") return ColorFormat::I420;
+    if (value == "yuyv") return ColorFormat::YUYV;
+    if (value == "uyvy") return ColorFormat::UYVY;
+    throw std::invalid_argument("Unknown color format: " + value);
+}
+
+// green | blur | image:<path> | video:<path>
+BackgroundSettings ParseBackground(const std::string& value)
+{
+    const auto colon = value.find(':');
+    const std::string kind = value.substr(0, colon);
+    const std::string path = colon == std::string::npos ? "" : value.substr(colon + 1);
+
+    if (kind == "green") return { BackgroundMode::COLOR, "" };
+    if (kind == "blur") return { BackgroundMode::BLUR, "" };
+    if (path.empty()) throw std::invalid_argument("Missing path for background: " + value);
+    if (kind == "image") return { BackgroundMode::IMAGE, path };
+    if (kind == "video") return { BackgroundMode::VIDEO, path };
+    throw std::invalid_argument("Unknown background: " + value);
+}
+
+OutputLayout ParseOutputLayout(const std::string& value)
+{
+    if (value == "composite") return OutputLayout::COMPOSITE;
+    if (value == "bgra") return OutputLayout::BGRA;
+    if (value == "planes") return OutputLayout::PLANES;
+    throw std::invalid_argument("Unknown output layout: " + value);
+}
+
+PairingMode ParsePairingMode(const std::string& value)
+{
+    if (value == "sdk") return PairingMode::SDK_SYNC;
+    if (value == "timestamp") return PairingMode::TIMESTAMP;
+    throw std::invalid_argument("Unknown pairing mode: " + value);
+}
+
+// Throw std::invalid_argument on anything unknown.
+export Options ParseOptions(const int argc, const char* const argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const auto nextValue = [&]() -> std::string {
+            if (i + 1 >= argc) throw std::invalid_argument("Missing value for " + arg);
+            return argv[++i];
+        };
+
+        if (arg == "--headless") options.headless = true;
+        else if (arg == "--sink") options.sink = nextValue();
+        else if (arg == "--cameras") options.maxCameras = ParseCount(arg, nextValue());
+        else if (arg == "--workers") options.workers = ParseCount(arg, nextValue());
+        else if (arg == "--budget") options.budgetMs = ParseCount(arg, nextValue());
+        else if (arg == "--warm-up") options.warmUpRuns = ParseCount(arg, nextValue());
+        else if (arg == "--pin") ParsePlacement(nextValue(), options.placement);
+        else if (arg == "--rt-capture") options.placement.realtimeCapture = true;
+        else if (arg == "--cv-threads") options.cvThreads = ParseCount(arg, nextValue());
+        else if (arg == "--pairing") options.pairing.mode = ParsePairingMode(nextValue());
+        else if (arg == "--pair-tolerance") options.pairing.toleranceMs = ParseCount(arg, nextValue());
+        else if (arg == "--depth-only") options.pairing.depthOnly = true;
+        else if (arg == "--color") options.color = ParseColorFormat(nextValue());
+        else if (arg == "--yuv-out") options.yuvOut = true;
+        else if (arg == "--output") options.output = ParseOutputLayout(nextValue());
+        else if (arg == "--background") options.background = ParseBackground(nextValue());
+        else if (arg == "--benchmark") options.benchmark = nextValue();
+        else if (arg == "--help" || arg == "-h") options.help = true;
+        else throw std::invalid_argument("Unknown option: " + arg);
+    }
+    // Only the sink takes these. A window shows the composite.
+    if (!options.headless && options.yuvOut) throw std::invalid_argument("--yuv-out needs --headless");
+    if (!options.headless && options.output != OutputLayout::COMPOSITE) {
+        throw std::invalid_argument("--output needs --headless");
+    }
+    return options;
+}
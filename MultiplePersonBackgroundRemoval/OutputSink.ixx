@@ -0,0 +1,258 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// Interface
+export module OutputSink;
+
+import Const;
+
+using namespace cv;
+
+// What a headless frame is made of.
+export enum class OutputLayout {
+    COMPOSITE,   // The persons over the background, as composited.
+    BGRA,        // The color with the mask or matte in alpha. The consumer composites.
+    PLANES       // The BGR color rows, then the 8-bit mask or matte rows.
+};
+
+// Where the processed output goes when there is no window.
+export class OutputSink
+{
+public:
+    virtual ~OutputSink() = default;
+    // fourcc: 0 for a BGR image, else the YUV layout of image, e.g. NV12 as a single channel Mat of 3/2 the rows.
+    virtual void Write(const Mat& image, const uint32_t fourcc) = 0;
+    // imgColor: BGR, or RGB if rgb. imgMatte: 0 to 255, the size of imgColor. layout: BGRA or PLANES.
+    virtual void WriteMatte(const Mat& imgColor, const bool rgb, const Mat& imgMatte, const OutputLayout layout) = 0;
+};
+
+// Color and matte interleaved into imgBgra, which has their size already. One pass, RGB swapped on the way.
+void MergeBgra(const Mat& imgColor, const bool rgb, const Mat& imgMatte, Mat& imgBgra)
+{
+    static constexpr int BGR_TO_BGRA[] = { 0, 0, 1, 1, 2, 2, 3, 3 };
+    static constexpr int RGB_TO_BGRA[] = { 2, 0, 1, 1, 0, 2, 3, 3 };
+    const Mat src[] = { imgColor, imgMatte };
+    mixChannels(src, 2, &imgBgra, 1, rgb ? RGB_TO_BGRA : BGR_TO_BGRA, 4);
+}
+
+// Color into imgBgr as BGR. imgBgr may wrap a buffer of the right size, which is then written in place.
+void CopyBgr(const Mat& imgColor, const bool rgb, Mat& imgBgr)
+{
+    if (rgb) cvtColor(imgColor, imgBgr, COLOR_RGB2BGR);
+    else imgColor.copyTo(imgBgr);
+}
+
+// Discard. For benchmarks.
+export class NullSink : public OutputSink
+{
+public:
+    void Write(const Mat&, const uint32_t) override {}
+    void WriteMatte(const Mat&, const bool, const Mat&, const OutputLayout) override {}
+};
+
+// Raw frames, rows back to back, to a file or a named pipe.
+export class FileSink : public OutputSink
+{
+private:
+    std::ofstream mStream;
+    Mat mImgFrame;   // BGRA or BGR frame made for WriteMatte.
+
+    void WriteRows(const Mat& image)
+    {
+        const auto rowBytes = static_cast<std::streamsize>(image.cols * image.elemSize());
+        for (int y = 0; y < image.rows; y++)
+        {
+            mStream.write(reinterpret_cast<const char*>(image.ptr(y)), rowBytes);
+        }
+    }
+
+public:
+    explicit FileSink(const std::string& path)
+        : mStream(path, std::ios::binary | std::ios::trunc) {
+        if (!mStream) throw std::runtime_error("Cannot open output: " + path);
+    }
+
+    void Write(const Mat& image, const uint32_t) override
+    {
+        WriteRows(image);
+        mStream.flush();
+    }
+
+    void WriteMatte(const Mat& imgColor, const bool rgb, const Mat& imgMatte, const OutputLayout layout) override
+    {
+        if (layout == OutputLayout::BGRA) {
+            mImgFrame.create(imgColor.size(), CV_8UC4);
+            MergeBgra(imgColor, rgb, imgMatte, mImgFrame);
+            WriteRows(mImgFrame);
+        }
+        else {
+            if (rgb) {
+                CopyBgr(imgColor, rgb, mImgFrame);
+                WriteRows(mImgFrame);
+            }
+            else WriteRows(imgColor);
+            WriteRows(imgMatte);
+        }
+        mStream.flush();
+    }
+};
+
+// Header in front of the frame in shared memory. Readers retry while sequence is odd or changed during their copy.
+export struct SharedFrameHeader
+{
+    static constexpr uint32_t MAGIC = 0x4D505242;   // "MPRB"
+    uint32_t magic;
+    uint32_t width, height, type, stride;           // type: OpenCV Mat type. Rows and columns of the Mat.
+    uint32_t fourcc;                                // 0: BGR. Else the YUV layout.
+    uint32_t maskOffset;                            // Planes: bytes from the frame start to the mask rows. Else 0.
+    std::atomic<uint64_t> sequence;                 // Odd while a frame is written.
+};
+
+// The latest frame in a named shared memory block.
+export class SharedMemorySink : public OutputSink
+{
+private:
+    static constexpr size_t MAX_FRAME_BYTES = static_cast<size_t>(W) * H * 4;    // Up to BGRA.
+    static constexpr size_t SIZE = sizeof(SharedFrameHeader) + MAX_FRAME_BYTES;
+    SharedFrameHeader* mHeader = nullptr;
+    uint8_t* mData = nullptr;
+#ifdef _WIN32
+    HANDLE mMapping = nullptr;
+#else
+    std::string mName;
+#endif
+
+    // Fill the frame data between the odd and the even sequence. fill writes straight into mData.
+    template <typename Fill>
+    void Publish(const int cols, const int rows, const int type, const uint32_t fourcc, const uint32_t maskOffset,
+        Fill fill)
+    {
+        const uint64_t sequence = mHeader->sequence.load(std::memory_order_relaxed);
+        mHeader->sequence.store(sequence + 1, std::memory_order_relaxed);    // Odd: writing.
+        std::atomic_thread_fence(std::memory_order_release);
+        mHeader->width = cols;
+        mHeader->height = rows;
+        mHeader->type = type;
+        mHeader->stride = static_cast<uint32_t>(cols * CV_ELEM_SIZE(type));
+        mHeader->fourcc = fourcc;
+        mHeader->maskOffset = maskOffset;
+        fill();
+        mHeader->sequence.store(sequence + 2, std::memory_order_release);    // Even: done.
+    }
+
+    // A larger color profile than W x H, picked when the camera has no W x H mode, would never fit. Stop with a
+    // message rather than publish nothing.
+    static void CheckFits(const size_t bytes, const Mat& image)
+    {
+        if (bytes <= MAX_FRAME_BYTES) return;
+        throw std::runtime_error("Frame of " + std::to_string(image.cols) + "x" + std::to_string(image.rows)
+            + " does not fit the shared memory block of " + std::to_string(MAX_FRAME_BYTES) + " bytes.");
+    }
+
+public:
+    explicit SharedMemorySink(const std::string& name)
+    {
+#ifdef _WIN32
+        mMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(SIZE), name.c_str());
+        if (!mMapping) throw std::runtime_error("Cannot create shared memory: " + name);
+        void* view = MapViewOfFile(mMapping, FILE_MAP_ALL_ACCESS, 0, 0, SIZE);
+        if (!view) {
+            CloseHandle(mMapping);
+            throw std::runtime_error("Cannot map shared memory: " + name);
+        }
+#else
+        mName = "/" + name;
+        const int fd = shm_open(mName.c_str(), O_CREAT | O_RDWR, 0600);
+        if (fd < 0) throw std::runtime_error("Cannot create shared memory: " + name);
+        void* view = ftruncate(fd, SIZE) == 0 ? mmap(nullptr, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (view == MAP_FAILED) throw std::runtime_error("Cannot map shared memory: " + name);
+#endif
+        mHeader = new (view) SharedFrameHeader{ SharedFrameHeader::MAGIC, 0, 0, 0, 0, 0, 0, {} };
+        mData = static_cast<uint8_t*>(view) + sizeof(SharedFrameHeader);
+    }
+
+    ~SharedMemorySink() override
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(mHeader);
+        CloseHandle(mMapping);
+#else
+        munmap(mHeader, SIZE);
+        shm_unlink(mName.c_str());
+#endif
+    }
+
+    SharedMemorySink(const SharedMemorySink&) = delete;
+    SharedMemorySink& operator=(const SharedMemorySink&) = delete;
+
+    void Write(const Mat& image, const uint32_t fourcc) override
+    {
+        const size_t rowBytes = image.cols * image.elemSize();
+        CheckFits(rowBytes * image.rows, image);
+
+        Publish(image.cols, image.rows, image.type(), fourcc, 0, [&] {
+            for (int y = 0; y < image.rows; y++)
+            {
+                memcpy(mData + y * rowBytes, image.ptr(y), rowBytes);
+            }
+        });
+    }
+
+    // Straight into the shared block, no frame in between: Mats wrapping mData are the destination of the one pass.
+    void WriteMatte(const Mat& imgColor, const bool rgb, const Mat& imgMatte, const OutputLayout layout) override
+    {
+        const size_t pixels = imgColor.total();
+        CheckFits(pixels * 4, imgColor);   // BGRA, or BGR and mask planes. 4 bytes a pixel either way.
+
+        if (layout == OutputLayout::BGRA) {
+            Publish(imgColor.cols, imgColor.rows, CV_8UC4, 0, 0, [&] {
+                Mat imgBgra(imgColor.size(), CV_8UC4, mData);
+                MergeBgra(imgColor, rgb, imgMatte, imgBgra);
+            });
+        }
+        else {
+            const uint32_t maskOffset = static_cast<uint32_t>(pixels * 3);
+            Publish(imgColor.cols, imgColor.rows, CV_8UC3, 0, maskOffset, [&] {
+                Mat imgBgr(imgColor.size(), CV_8UC3, mData);
+                Mat imgMask(imgColor.size(), CV_8UC1, mData + maskOffset);
+                CopyBgr(imgColor, rgb, imgBgr);
+                imgMatte.copyTo(imgMask);
+            });
+        }
+    }
+};
+
+// sink: null | file:<path> | pipe:<path> | shm:<name>
+export std::unique_ptr<OutputSink> MakeOutputSink(const std::string& sink)
+{
+    const auto colon = sink.find(':');
+    const std::string kind = sink.substr(0, colon);
+    const std::string target = colon == std::string::npos ? "" : sink.substr(colon + 1);
+
+    if (kind == "null") return std::make_unique<NullSink>();
+    if (target.empty()) throw std::invalid_argument("Missing target for sink: " + sink);
+    if (kind == "file" || kind == "pipe") return std::make_unique<FileSink>(target);
+    if (kind == "shm") return std::make_unique<SharedMemorySink>(target);
+    throw std::invalid_argument("Unknown sink: " + sink);
+}
@@ -0,0 +1,537 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <bit>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <stop_token>
+#include <condition_variable>
+#pragma warning(disable: 4251 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+#include <libobsensor/hpp/Frame.hpp>
+#include "window.hpp"
+
+// Interface
+export module ProcessingPipeline;
+
+import Const;
+import SpscQueue;
+import TripleBuffer;
+import MotionGate;
+import FaceDetection;
+import ForegroundGate;
+import HeadBlobDetector;
+import HumanObjectTracker;
+import LatencyStats;
+import WorkerPool;
+import QualityController;
+import ThreadAffinity;
+import FramePairing;
+import DepthKernel;
+import MjpegDecoder;
+import YuvColor;
+import CompositeKernel;
+import MaskCleanup;
+import MaskRefiner;
+import Background;
+
+using namespace cv;
+
+const Scalar GREEN_SCREEN_COLOR(64, 177, 0);   // RGB: (0, 177, 64)
+// Head blobs are opt-in. Any head sized blob in range, a chair back or a lamp, is seeded and kept as a person.
+constexpr SeedStrategy SEED_STRATEGY = SeedStrategy::FACE_ONLY;
+constexpr bool COLORIZE_DEPTH_PREVIEW = false;   // Color map instead of gray for the depth panel.
+
+// Everything one frame needs on its way through the stages. Preallocated and recycled.
+export struct FrameSlot
+{
+    FramePair frames;                     // Keeps the SDK frames alive while the slot is in use.
+    int frameNumber = 0;
+    bool reuse = false;                   // Nothing changed. Previous faces and mask are reused.
+    bool depthOnly = false;               // Color lagged. imgColor is the last color frame.
+    Mat imgColor;                         // BGR, or RGB if colorRgb.
+    bool colorRgb = false;                // imgColor is the RGB888 SDK buffer itself, kept alive by frames.
+    bool colorPending = false;            // MJPG or YUV not made into imgColor yet. The first stage that needs it does.
+    YuvLayout colorYuv = YuvLayout::NONE; // Layout of imgColorYuv.
+    Mat imgColorYuv;                      // The YUV SDK buffer itself, kept alive by frames.
+    Mat imgColorThumb;                    // MJPG decoded at 1/8, for the motion gate.
+    Mat imgColorDetect;                   // MJPG or YUV at the detection scale.
+    Mat imgDepth;                         // 8-bit depth, n*16mm.
+    Mat imgDepthBits;                     // In-range depth, one bit per pixel.
+    Mat imgDepthThumb;                    // 1/8 depth thumbnail for the gates.
+    std::vector<Rect> faceBoxes;
+    std::vector<Point2i> faceCenters;
+    std::vector<Point2i> headCenters;
+    Mat imgMask;                          // Mask for all persons. 0 and 255 binary image.
+    Mat imgAlpha;                         // imgMask with soft edges, 0 to 255. Empty if not refined.
+    Mat imgOut;                           // Output image.
+    uint32_t outFourcc = 0;               // imgOut is YUV with this four character code. 0: BGR.
+    Mat imgColorPreview;                  // BGR color, for the preview panel. Empty without preview.
+    Mat imgDepthPreview;                  // Depth as RGB, for the preview panel. Written at convert. Empty without preview.
+    int qualityLevel = 0;                 // Taken once at convert, so all stages of a frame agree.
+    QualitySettings quality;
+    FrameTiming timing;
+
+    // The soft edged matte if refined, else the mask.
+    const Mat& Matte() const noexcept { return imgAlpha.empty() ? imgMask : imgAlpha; }
+};
+
+// What a stage does when its input queue backs up.
+export enum class QueuePolicy {
+    BACKPRESSURE,    // The upstream stage waits for space. No frame is lost.
+    DROP_OLDEST      // The stage skips to the newest frame. Older frames are recycled.
+};
+
+// Convert runs on its own thread, waiting for the camera. Detect -> segment -> refine -> composite are jobs on a
+// worker pool shared with the other cameras. Present runs on the caller's thread.
+// Frame N+2 is converted while N+1 is detected and N is segmented, so throughput is bound by the slowest stage.
+export class ProcessingPipeline
+{
+private:
+    static constexpr int NUM_SLOTS = 8;
+    static constexpr size_t QUEUE_CAPACITY = 2;
+    static constexpr QueuePolicy DETECT_POLICY = QueuePolicy::BACKPRESSURE;
+    static constexpr QueuePolicy SEGMENT_POLICY = QueuePolicy::BACKPRESSURE;
+    static constexpr QueuePolicy REFINE_POLICY = QueuePolicy::BACKPRESSURE;
+    static constexpr QueuePolicy COMPOSITE_POLICY = QueuePolicy::BACKPRESSURE;
+    static constexpr QueuePolicy PRESENT_POLICY = QueuePolicy::DROP_OLDEST;
+
+    using SlotQueue = SpscQueue<FrameSlot*, QUEUE_CAPACITY>;
+
+    std::array<FrameSlot, NUM_SLOTS> mSlots;
+    std::vector<FrameSlot*> mFreeSlots;      // Returned from any stage, taken by convert.
+    std::mutex mFreeMutex;
+    std::condition_variable_any mFreeCondition;
+
+    SlotQueue mToDetect, mToSegment, mToRefine, mToComposite, mToPresent;
+    std::atomic<uint64_t> mDropped{ 0 };      // Frames recycled by DROP_OLDEST.
+    std::atomic<uint64_t> mIncomplete{ 0 };   // Frame sets without color or depth.
+    std::atomic<bool> mPreview{ true };       // Produce the preview panels. Not needed without a window.
+    std::atomic<int> mQualityLevel{ 0 };      // Set by the quality controller.
+    std::atomic<bool> mYuvOutput{ false };    // Composite YUV color as YUV, for sinks that take it.
+    std::atomic<bool> mMatteOutput{ false };  // No composite. The sink gets color and matte.
+
+    // Stage state. Each is only touched by its own stage.
+    TripleBuffer<FramePair>& mFramePairs;                        // Convert.
+    std::shared_ptr<ob::ColorFrame> mLastColorFrame;             // For depth only pairs.
+    const Mat mDepthLut = MakeDepthLut(COLORIZE_DEPTH_PREVIEW);
+    Mat mImgDepth8, mImgDepth16;                                 // Depth formats other than Y16.
+    Mat mImgLuma;                                                // YUV luma for the motion gate.
+    MjpegDecoder mThumbDecoder;
+    MotionGate mMotionGate;
+    int mFrameNumber = 0;
+    FaceDetection& mFaceDet;                                     // Detect.
+    MjpegDecoder mDetectDecoder;
+    ForegroundGate mFgGate;
+    HeadBlobDetector mHeadDet;
+    std::vector<Rect> mLastFaceBoxes;
+    std::vector<Point2i> mLastFaceCenters, mLastHeadCenters;
+    int mFramesSinceDetect = 0;
+    HumanObjectTracker mTracker;                                 // Segment.
+    std::vector<Point2i> mSeeds;
+    MaskCleanup mCleanup;
+    MaskRefiner mRefiner;                                        // Refine.
+    MjpegDecoder mRefineDecoder;
+    Mat mImgRefineGuide;                                         // YUV luma.
+    Mat mImgLastAlpha;                                           // For frames that reuse the mask.
+    MjpegDecoder mCompositeDecoder;                              // Composite.
+    BackgroundSource mBackground;
+
+    WorkerPool& mPool;
+    std::vector<WorkerPool::JobId> mJobs;
+
+    // Declared last. Stopped and joined first, while everything above is still alive.
+    std::jthread mConvertWorker;
+
+    FrameSlot* AcquireSlot(std::stop_token stopToken);
+    bool TryPopSlot(SlotQueue& queue, FrameSlot*& slot, const QueuePolicy policy);
+
+    void Convert(std::stop_token stopToken);
+    void Detect(FrameSlot& slot);
+    void Segment(FrameSlot& slot);
+    void Refine(FrameSlot& slot);
+    void Composite(FrameSlot& slot);
+    // YUV over the flat color without a preview is never converted whole: only the person pixels, or nothing for a
+    // YUV sink.
+    bool CompositesFromYuv(const FrameSlot& slot) const;
+    // Pool job. Pop one frame from one queue, work, push it to the next. Return false if there was nothing to do.
+    template <typename Work>
+    bool StepStage(const Stage stage, SlotQueue& in, const QueuePolicy policy, SlotQueue& out, Work work);
+
+public:
+    // frameSize: the color frame size, to make the background to. Throws if the background cannot be opened.
+    ProcessingPipeline(TripleBuffer<FramePair>& framePairs, FaceDetection& faceDet,
+        const HeadBlobDetector& headDet, WorkerPool& pool, const BackgroundSettings& background, const Size& frameSize);
+    ~ProcessingPipeline();
+    ProcessingPipeline(const ProcessingPipeline&) = delete;
+    ProcessingPipeline& operator=(const ProcessingPipeline&) = delete;
+
+    // Present stage. Sleep until a frame is finished, up to timeout. Return the newest one or nullptr.
+    // Hand it back with Recycle() when shown.
+    FrameSlot* WaitPresent(const std::chrono::milliseconds timeout);
+    void Recycle(FrameSlot* slot);
+
+    void SetPreview(const bool preview) noexcept { mPreview = preview; }
+    // YUV color frames without a preview come out as YUV of the same layout. See FrameSlot::outFourcc.
+    void SetYuvOutput(const bool yuvOutput) noexcept { mYuvOutput = yuvOutput; }
+    // Leave compositing to the consumer. Frames keep full color in imgColor and the matte, no imgOut.
+    void SetMatteOutput(const bool matteOutput) noexcept { mMatteOutput = matteOutput; }
+    // Applies from the next converted frame. Frames in flight keep their level.
+    void SetQualityLevel(const int level) noexcept { mQualityLevel = level; }
+
+    uint64_t Dropped() const noexcept { return mDropped.load(std::memory_order_relaxed); }
+    uint64_t Incomplete() const noexcept { return mIncomplete.load(std::memory_order_relaxed); }
+};
+
+module: private;
+
+ProcessingPipeline::ProcessingPipeline(TripleBuffer<FramePair>& framePairs,
+    FaceDetection& faceDet, const HeadBlobDetector& headDet, WorkerPool& pool, const BackgroundSettings& background,
+    const Size& frameSize)
+    : mFramePairs(framePairs), mFaceDet(faceDet), mHeadDet(headDet), mBackground(background, frameSize), mPool(pool)
+{
+    mFreeSlots.reserve(NUM_SLOTS);
+    for (auto& slot : mSlots) mFreeSlots.push_back(&slot);
+
+    mJobs.push_back(mPool.Add([this] {
+        return StepStage(Stage::DETECT, mToDetect, DETECT_POLICY, mToSegment, [this](FrameSlot& slot) { Detect(slot); }); }));
+    mJobs.push_back(mPool.Add([this] {
+        return StepStage(Stage::SEGMENT, mToSegment, SEGMENT_POLICY, mToRefine, [this](FrameSlot& slot) { Segment(slot); }); }));
+    mJobs.push_back(mPool.Add([this] {
+        return StepStage(Stage::REFINE, mToRefine, REFINE_POLICY, mToComposite, [this](FrameSlot& slot) { Refine(slot); }); }));
+    mJobs.push_back(mPool.Add([this] {
+        return StepStage(Stage::COMPOSITE, mToComposite, COMPOSITE_POLICY, mToPresent,
+            [this](FrameSlot& slot) { Composite(slot); }); }));
+    mConvertWorker = std::jthread([this](std::stop_token stopToken) { Convert(stopToken); });
+}
+
+ProcessingPipeline::~ProcessingPipeline()
+{
+    // Take the stages off the pool before the state they use goes away.
+    for (const auto job : mJobs) mPool.Remove(job);
+}
+
+FrameSlot* ProcessingPipeline::AcquireSlot(std::stop_token stopToken)
+{
+    std::unique_lock<std::mutex> lock(mFreeMutex);
+    if (!mFreeCondition.wait(lock, stopToken, [this] { return !mFreeSlots.empty(); })) return nullptr;
+    FrameSlot* slot = mFreeSlots.back();
+    mFreeSlots.pop_back();
+    return slot;
+}
+
+void ProcessingPipeline::Recycle(FrameSlot* slot)
+{
+    slot->frames = {};   // Release the SDK frames.
+    if (slot->colorRgb) slot->imgColor.release();   // It pointed into them.
+    slot->imgColorYuv.release();
+    {
+        std::lock_guard<std::mutex> lock(mFreeMutex);
+        mFreeSlots.push_back(slot);
+    }
+    mFreeCondition.notify_one();
+}
+
+bool ProcessingPipeline::TryPopSlot(SlotQueue& queue, FrameSlot*& slot, const QueuePolicy policy)
+{
+    if (!queue.TryPop(slot)) return false;
+    if (policy == QueuePolicy::DROP_OLDEST)
+    {
+        FrameSlot* newer = nullptr;
+        while (queue.TryPop(newer))
+        {
+            Recycle(slot);
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            slot = newer;
+        }
+    }
+    return true;
+}
+
+template <typename Work>
+bool ProcessingPipeline::StepStage(const Stage stage, SlotQueue& in, const QueuePolicy policy, SlotQueue& out,
+    Work work)
+{
+    // Backpressure. This stage is the only producer of out, so out cannot fill up again before the push below.
+    if (out.Full()) return false;
+    FrameSlot* slot = nullptr;
+    if (!TryPopSlot(in, slot, policy)) return false;
+    slot->timing.Begin(stage);
+    work(*slot);
+    slot->timing.End(stage);
+    out.TryPush(slot);
+    return true;
+}
+
+FrameSlot* ProcessingPipeline::WaitPresent(const std::chrono::milliseconds timeout)
+{
+    FrameSlot* slot = nullptr;
+    if (!mToPresent.PopFor(slot, timeout)) return nullptr;
+    mPool.Notify();   // Composite may have been waiting for room.
+    if constexpr (PRESENT_POLICY == QueuePolicy::DROP_OLDEST)
+    {
+        FrameSlot* newer = nullptr;
+        while (mToPresent.TryPop(newer))
+        {
+            Recycle(slot);
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            slot = newer;
+        }
+    }
+    return slot;
+}
+
+static YuvLayout YuvLayoutOf(const OBFormat format)
+{
+    switch (format) {
+    case OB_FORMAT_NV12: return YuvLayout::NV12;
+    case OB_FORMAT_NV21: return YuvLayout::NV21;
+    case OB_FORMAT_I420: return YuvLayout::I420;
+    case OB_FORMAT_YUYV:
+    case OB_FORMAT_YUY2: return YuvLayout::YUYV;
+    case OB_FORMAT_UYVY: return YuvLayout::UYVY;
+    default: return YuvLayout::NONE;
+    }
+}
+
+// Stage 0. Color/depth pair to BGR color and 8-bit depth.
+void ProcessingPipeline::Convert(std::stop_token stopToken)
+{
+    EnterRole(ThreadRole::CONVERT);
+    FramePair pair;
+    while (!stopToken.stop_requested())
+    {
+        mFramePairs.Wait(stopToken);
+        if (!mFramePairs.Read(pair)) continue;
+
+        // Depth only. Segment the new depth under the last color frame.
+        const bool depthOnly = !pair.color;
+        if (depthOnly) pair.color = mLastColorFrame;
+        auto colorFrame = pair.color;
+        auto depthFrame = pair.depth;
+        if (!colorFrame || !depthFrame) {
+            mIncomplete.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        mLastColorFrame = colorFrame;
+
+        FrameSlot* slot = AcquireSlot(stopToken);
+        if (!slot) return;
+        FrameTiming& timing = slot->timing;
+        timing.Begin(Stage::CONVERT);
+        timing.pipelineEntrySystemMs = SystemTimeMs();
+        timing.deviceTimeStampMs = colorFrame->timeStamp();
+        timing.depthDeviceTimeStampMs = depthFrame->timeStamp();
+        timing.systemTimeStampMs = (depthOnly ? *depthFrame : *colorFrame).systemTimeStamp();
+        timing.depthSystemTimeStampMs = depthFrame->systemTimeStamp();
+        timing.pairedSystemMs = pair.pairedSystemMs;
+        slot->frames = std::move(pair);
+        slot->frameNumber = ++mFrameNumber;
+        slot->depthOnly = depthOnly;
+        slot->qualityLevel = mQualityLevel.load(std::memory_order_relaxed);
+        slot->quality = QualityAt(slot->qualityLevel);
+        slot->quality.preview = slot->quality.preview && mPreview;
+        // RGB888 is used in place. Consumers read RGB or swap on a copy they make anyway.
+        // MJPG is only decoded at 1/8 here. The full image is decoded on the pool, at the size a stage needs.
+        // YUV is only wrapped. The motion gate reads its luma.
+        slot->colorRgb = colorFrame->format() == OB_FORMAT_RGB888;
+        slot->colorYuv = YuvLayoutOf(colorFrame->format());
+        slot->colorPending = colorFrame->format() == OB_FORMAT_MJPG || slot->colorYuv != YuvLayout::NONE;
+        bool colorDone = true;
+        if (slot->colorRgb) slot->imgColor = Mat(colorFrame->height(), colorFrame->width(), CV_8UC3, colorFrame->data());
+        else if (slot->colorYuv != YuvLayout::NONE) {
+            slot->imgColorYuv = WrapYuv(colorFrame->data(), colorFrame->width(), colorFrame->height(), slot->colorYuv);
+            colorDone = slot->imgColorYuv.total() * slot->imgColorYuv.elemSize() <= colorFrame->dataSize();
+            if (colorDone) YuvLuma(slot->imgColorYuv, slot->colorYuv, mImgLuma);
+        }
+        else if (slot->colorPending) colorDone = mThumbDecoder.Decode(static_cast<const uint8_t*>(colorFrame->data()),
+            colorFrame->dataSize(), slot->imgColorThumb, DEPTH_THUMB_SCALE);
+        else {
+            // convertFrame leaves formats it does not know untouched. Empty, not the last frame, then.
+            slot->imgColor.release();
+            Window::convertFrame(*colorFrame, slot->imgColor);
+        }
+        // One pass over the depth for everything derived from it.
+        const bool y16 = depthFrame->format() == OB_FORMAT_Y16;
+        if (!y16) {
+            mImgDepth8.release();
+            mImgDepth16.release();
+            Window::convertFrame(*depthFrame, mImgDepth8);
+            mImgDepth8.convertTo(mImgDepth16, CV_16U);
+        }
+        if (!colorDone || (!slot->colorPending && slot->imgColor.empty()) || (!y16 && mImgDepth16.empty())) {
+            mIncomplete.fetch_add(1, std::memory_order_relaxed);
+            Recycle(slot);
+            continue;
+        }
+        const Mat imgY16 = y16 ? Mat(depthFrame->height(), depthFrame->width(), CV_16UC1, depthFrame->data()) : mImgDepth16;
+        const int shift = y16 ? std::max(0, static_cast<int>(depthFrame->pixelAvailableBitSize()) - 10) : 0;
+        ConvertDepth(imgY16, shift, slot->quality.preview ? mDepthLut : Mat(), slot->imgDepth, slot->imgDepthBits,
+            slot->imgDepthThumb, slot->imgDepthPreview);
+        if (!slot->quality.preview) slot->imgDepthPreview.release();
+
+        // Nothing changed since the last fully processed frame. Reuse its faces and mask.
+        const Mat& imgGateColor = slot->colorYuv != YuvLayout::NONE ? mImgLuma
+            : slot->colorPending ? slot->imgColorThumb : slot->imgColor;
+        slot->reuse = mMotionGate.CanReuse(imgGateColor, slot->colorRgb, slot->imgDepthThumb);
+        timing.End(Stage::CONVERT);
+        if (!mToDetect.Push(slot, stopToken)) return;
+        mPool.Notify();
+    }
+}
+
+// Make the full size BGR color in the slot's own buffer, once per frame. MJPG is decoded, YUV converted.
+static void MakeFullColor(MjpegDecoder& decoder, FrameSlot& slot)
+{
+    if (!slot.colorPending) return;
+    slot.colorPending = false;
+    if (slot.colorYuv != YuvLayout::NONE) {
+        YuvToBgr(slot.imgColorYuv, slot.colorYuv, slot.imgColor);
+        return;
+    }
+    const auto& color = slot.frames.color;
+    // The thumbnail decode at convert has read the whole stream, so this rarely fails.
+    if (!decoder.Decode(static_cast<const uint8_t*>(color->data()), color->dataSize(), slot.imgColor)) {
+        slot.imgColor.create(color->height(), color->width(), CV_8UC3);
+        slot.imgColor.setTo(Scalar::all(0));
+    }
+}
+
+// Stage 1. Person seeds.
+void ProcessingPipeline::Detect(FrameSlot& slot)
+{
+    // At a reduced quality, detect on every n-th frame only and reuse the seeds in between.
+    if (!slot.reuse && ++mFramesSinceDetect >= slot.quality.detectInterval)
+    {
+        mFramesSinceDetect = 0;
+        // 1a. RGB image for face detection. Only search where the depth is in the working range.
+        // The color of a depth only frame is stale. Keep the faces found in the last fresh one.
+        if constexpr (SEED_STRATEGY != SeedStrategy::DEPTH_ONLY) {
+            if (!slot.depthOnly) {
+                // MJPG at a reduced detection scale is decoded straight at 1/2 or 1/4 in the DCT.
+                // YUV is converted and downscaled in one pass.
+                const auto& color = slot.frames.color;
+                const int scaleDenom = cvRound(1.0F / slot.quality.detectScale);
+                bool prescaled = false;
+                if (slot.colorPending && scaleDenom > 1) {
+                    if (slot.colorYuv == YuvLayout::NONE) prescaled = mDetectDecoder.Decode(
+                        static_cast<const uint8_t*>(color->data()), color->dataSize(), slot.imgColorDetect, scaleDenom);
+                    else if (std::has_single_bit(static_cast<unsigned>(scaleDenom))) {
+                        YuvToBgrScaled(slot.imgColorYuv, slot.colorYuv, std::countr_zero(static_cast<unsigned>(scaleDenom)),
+                            slot.imgColorDetect);
+                        prescaled = true;
+                    }
+                }
+                if (!prescaled) MakeFullColor(mDetectDecoder, slot);
+                mLastFaceCenters = mFaceDet.Detect(prescaled ? slot.imgColorDetect : slot.imgColor, slot.imgDepth,
+                    mFgGate.FindBoxes(slot.imgDepthThumb, slot.imgDepth.size()), slot.quality.detectScale, slot.colorRgb,
+                    prescaled);
+                mFaceDet.FaceBoxes(mLastFaceBoxes);
+            }
+        }
+        // 1b. Depth image for head blobs. Persons facing away have no face.
+        if constexpr (SEED_STRATEGY != SeedStrategy::FACE_ONLY) {
+            mLastHeadCenters = mHeadDet.Detect(slot.imgDepth, slot.imgDepthBits);
+        }
+    }
+    // Copy into the slot buffers. No allocation once they have grown.
+    slot.faceBoxes = mLastFaceBoxes;
+    slot.faceCenters = mLastFaceCenters;
+    slot.headCenters = mLastHeadCenters;
+}
+
+// Stage 2. Depth image for human object tracking.
+void ProcessingPipeline::Segment(FrameSlot& slot)
+{
+    if (!slot.reuse)
+    {
+        mSeeds.clear();
+        mSeeds.insert(mSeeds.end(), slot.faceCenters.begin(), slot.faceCenters.end());
+        mSeeds.insert(mSeeds.end(), slot.headCenters.begin(), slot.headCenters.end());
+        mTracker.ProcessFrameWithFaces(slot.imgDepth, mSeeds, slot.quality.segmentLevel);
+        // In place. Frames that reuse the mask get it cleaned already.
+        mCleanup.Clean(mTracker.Mask());
+    }
+    mTracker.Mask().copyTo(slot.imgMask);
+}
+
+bool ProcessingPipeline::CompositesFromYuv(const FrameSlot& slot) const
+{
+    return mBackground.Solid() && slot.colorPending && slot.colorYuv != YuvLayout::NONE && !slot.quality.preview;
+}
+
+// Stage 3. Soft mask edges that follow the color image.
+void ProcessingPipeline::Refine(FrameSlot& slot)
+{
+    // A YUV sink gets the hard mask. Its chroma is shared by several pixels anyway.
+    if (!slot.quality.refineEdges || (mYuvOutput && !mMatteOutput && CompositesFromYuv(slot))) {
+        slot.imgAlpha.release();
+        mImgLastAlpha.release();
+        return;
+    }
+    // Same mask and color as the last refined frame.
+    if (slot.reuse && !mImgLastAlpha.empty()) {
+        mImgLastAlpha.copyTo(slot.imgAlpha);
+        return;
+    }
+    // YUV guides with its luma as it is. MJPG is decoded here, for the composite as well.
+    if (slot.colorPending && slot.colorYuv != YuvLayout::NONE) {
+        YuvLuma(slot.imgColorYuv, slot.colorYuv, mImgRefineGuide);
+        mRefiner.Refine(mImgRefineGuide, false, slot.imgMask, slot.imgAlpha);
+    }
+    else {
+        MakeFullColor(mRefineDecoder, slot);
+        mRefiner.Refine(slot.imgColor, slot.colorRgb, slot.imgMask, slot.imgAlpha);
+    }
+    slot.imgAlpha.copyTo(mImgLastAlpha);
+}
+
+// Stage 4. Copy original image to masked area to create output image.
+void ProcessingPipeline::Composite(FrameSlot& slot)
+{
+    if (mMatteOutput) {
+        // The sink writes color and matte as they are. Only the color has to be whole.
+        MakeFullColor(mCompositeDecoder, slot);
+        slot.imgOut.release();
+        slot.outFourcc = 0;
+        slot.imgColorPreview.release();
+        return;
+    }
+    const bool soft = !slot.imgAlpha.empty();
+    const Mat& imgMatte = slot.Matte();
+    if (CompositesFromYuv(slot)) {
+        if (mYuvOutput) {
+            CompositeYuv(slot.imgColorYuv, slot.colorYuv, slot.imgMask, GREEN_SCREEN_COLOR, slot.imgOut);
+            slot.outFourcc = YuvFourcc(slot.colorYuv);
+        }
+        else {
+            CompositeYuvToBgr(slot.imgColorYuv, slot.colorYuv, imgMatte, GREEN_SCREEN_COLOR, slot.imgOut);
+            slot.outFourcc = 0;
+        }
+        slot.imgColorPreview.release();
+        return;
+    }
+    slot.outFourcc = 0;
+    MakeFullColor(mCompositeDecoder, slot);
+    // One select pass into the slot's buffer. RGB is swapped on the way.
+    const MaskFormat format = soft ? MaskFormat::ALPHA : MaskFormat::BYTES;
+    if (mBackground.Solid()) CompositeColor(slot.imgColor, slot.colorRgb, imgMatte, format, GREEN_SCREEN_COLOR, slot.imgOut);
+    else CompositeColor(slot.imgColor, slot.colorRgb, imgMatte, format, mBackground.Next(slot.imgColor, slot.colorRgb),
+        slot.imgOut);
+
+    // RENDER_GRID needs all mats to be the same shape (480, 640, 3).
+    if (slot.quality.preview) {
+        // Visualization draws on the preview. Never on the SDK buffer.
+        if (slot.colorRgb) cvtColor(slot.imgColor, slot.imgColorPreview, COLOR_RGB2BGR);
+        else slot.imgColorPreview = slot.imgColor;   // Converted already. Ours to draw on.
+    }
+    else {
+        slot.imgColorPreview.release();
+    }
+}
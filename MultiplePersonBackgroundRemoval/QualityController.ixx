@@ -0,0 +1,92 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <array>
+#include <algorithm>
+
+// Interface
+export module QualityController;
+
+import LatencyStats;
+
+// How much work a frame gets. The cheaper settings give up accuracy, never correctness.
+export struct QualitySettings
+{
+    bool preview = true;          // Annotated color and depth panels next to the output.
+    float detectScale = 1.0F;     // Color image scale for face detection.
+    int detectInterval = 1;       // Detect every n-th frame. Seeds are reused in between.
+    int segmentLevel = 0;         // Pyramid level of the flood fill. 1: half resolution.
+    bool refineEdges = true;      // Guided filter on the mask edges. Hard edges without.
+};
+
+// Best first. Each step gives up the least visible quality for the most time.
+constexpr std::array<QualitySettings, 7> QUALITY_LADDER = { {
+    { true, 1.0F, 1, 0, true },
+    { false, 1.0F, 1, 0, true },
+    { false, 1.0F, 1, 0, false },
+    { false, 0.5F, 1, 0, false },
+    { false, 0.5F, 2, 0, false },
+    { false, 0.5F, 2, 1, false },
+    { false, 0.5F, 4, 1, false },
+} };
+export constexpr int NUM_QUALITY_LEVELS = static_cast<int>(QUALITY_LADDER.size());
+
+export const QualitySettings& QualityAt(const int level) noexcept
+{
+    return QUALITY_LADDER[std::clamp(level, 0, NUM_QUALITY_LEVELS - 1)];
+}
+
+// Steps down the quality ladder when the work per frame exceeds the budget, and back up when there is headroom.
+// Feed it from the present stage only.
+export class QualityController
+{
+private:
+    static constexpr double SMOOTHING = 0.1;        // Exponential moving average weight of the newest frame.
+    static constexpr double HEADROOM = 0.6;         // Step up only while the work fits this part of the budget.
+    static constexpr int DOWN_SAMPLES = 5;          // Frames at a level before stepping down.
+    static constexpr int UP_SAMPLES = 60;           // Frames at a level before stepping up. Doubles if it bounces.
+    static constexpr int MAX_UP_SAMPLES = 16 * UP_SAMPLES;
+
+    double mBudgetMs;
+    int mLevel = 0;
+    double mSmoothedMs = 0;
+    int mSamples = 0;                // Frames seen at the current level.
+    int mUpSamples = UP_SAMPLES;
+    bool mSteppedUp = false;         // The last change was a step up.
+
+    void Change(const int level) noexcept
+    {
+        mSteppedUp = level < mLevel;
+        mLevel = level;
+        mSamples = 0;
+    }
+
+public:
+    explicit QualityController(const double budgetMs) noexcept : mBudgetMs(budgetMs) {}
+
+    // Return true if the level changed.
+    bool Update(const FrameTiming& timing, const int frameLevel) noexcept
+    {
+        if (frameLevel != mLevel) return false;   // Still in flight from before the last change.
+
+        const double workMs = timing.WorkMs();
+        mSmoothedMs = mSamples == 0 ? workMs : mSmoothedMs + SMOOTHING * (workMs - mSmoothedMs);
+        mSamples++;
+
+        if (mSmoothedMs > mBudgetMs && mLevel < NUM_QUALITY_LEVELS - 1 && mSamples >= DOWN_SAMPLES) {
+            // Stepped up too early. Wait longer before the next try.
+            if (mSteppedUp && mSamples < mUpSamples) mUpSamples = std::min(mUpSamples * 2, MAX_UP_SAMPLES);
+            Change(mLevel + 1);
+            return true;
+        }
+        if (mSmoothedMs < mBudgetMs * HEADROOM && mLevel > 0 && mSamples >= mUpSamples) {
+            Change(mLevel - 1);
+            return true;
+        }
+        return false;
+    }
+
+    int Level() const noexcept { return mLevel; }
+    double SmoothedMs() const noexcept { return mSmoothedMs; }
+    double BudgetMs() const noexcept { return mBudgetMs; }
+};
@@ -0,0 +1,51 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <vector>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/core.hpp>
+#include "simd.hpp"
+
+// Interface
+export module SimdPath;
+
+using namespace cv;
+
+// The kernel paths, shared by every kernel module so they all take the same path on a CPU.
+export enum class SimdPath { SCALAR, SSE2, AVX2 };
+export const char* SimdPathName(const SimdPath path);
+// The widest path this CPU and build support.
+export SimdPath BestSimdPath();
+// Every path this CPU and build support, scalar first. For benchmarks.
+export std::vector<SimdPath> SupportedSimdPaths();
+
+module: private;
+
+const char* SimdPathName(const SimdPath path)
+{
+    switch (path) {
+    case SimdPath::AVX2: return "AVX2";
+    case SimdPath::SSE2: return "SSE2";
+    default: return "scalar";
+    }
+}
+
+SimdPath BestSimdPath()
+{
+#ifdef SIMD_AVX2
+    if (checkHardwareSupport(CV_CPU_AVX2)) return SimdPath::AVX2;
+#endif
+#ifdef SIMD_SSE2
+    return SimdPath::SSE2;
+#else
+    return SimdPath::SCALAR;
+#endif
+}
+
+std::vector<SimdPath> SupportedSimdPaths()
+{
+    std::vector<SimdPath> paths = { SimdPath::SCALAR };
+    if (BestSimdPath() != SimdPath::SCALAR) paths.push_back(SimdPath::SSE2);
+    if (BestSimdPath() == SimdPath::AVX2) paths.push_back(SimdPath::AVX2);
+    return paths;
+}
@@ -0,0 +1,107 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstddef>
+#include <stop_token>
+#include <condition_variable>
+
+// Interface
+export module SpscQueue;
+
+// Bounded single-producer single-consumer ring. Push and pop are lock-free while the other side is not waiting.
+// The mutex is only used to sleep on while the queue is empty or full.
+export template <typename T, size_t CAPACITY>
+class SpscQueue
+{
+private:
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2.");
+    static constexpr size_t INDEX_MASK = CAPACITY - 1;
+
+    T mItems[CAPACITY];
+    alignas(64) std::atomic<size_t> mHead{ 0 };   // Next to pop. Advanced by the consumer.
+    alignas(64) std::atomic<size_t> mTail{ 0 };   // Next to push. Advanced by the producer.
+    std::atomic<int> mWaiters{ 0 };                // Threads in Sleep.
+    std::mutex mMutex;
+    std::condition_variable_any mCondition;
+
+    // Nothing to do unless the other side sleeps. The fence orders the index store before the waiter count load, as
+    // the increment in Sleep orders the count before the waiter's check. Lock before notifying, so a waiter between
+    // its check and its sleep cannot miss the change.
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mWaiters.load(std::memory_order_relaxed) == 0) return;
+        { std::lock_guard<std::mutex> lock(mMutex); }
+        mCondition.notify_all();
+    }
+
+    // Wait on the condition, counted in mWaiters. Return what wait returns.
+    template <typename Wait>
+    bool Sleep(Wait wait)
+    {
+        mWaiters.fetch_add(1, std::memory_order_seq_cst);
+        std::unique_lock<std::mutex> lock(mMutex);
+        const bool ready = wait(lock);
+        mWaiters.fetch_sub(1, std::memory_order_relaxed);
+        return ready;
+    }
+
+public:
+    size_t Size() const noexcept { return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire); }
+    bool Empty() const noexcept { return Size() == 0; }
+    bool Full() const noexcept { return Size() == CAPACITY; }
+
+    // Producer. Return false if full.
+    bool TryPush(const T& item)
+    {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == CAPACITY) return false;
+        mItems[tail & INDEX_MASK] = item;
+        mTail.store(tail + 1, std::memory_order_release);
+        Notify();
+        return true;
+    }
+
+    // Consumer. Return false if empty.
+    bool TryPop(T& item)
+    {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (mTail.load(std::memory_order_acquire) == head) return false;
+        item = mItems[head & INDEX_MASK];
+        mHead.store(head + 1, std::memory_order_release);
+        Notify();
+        return true;
+    }
+
+    // Producer. Wait for space. Return false if stopped.
+    bool Push(const T& item, std::stop_token stopToken)
+    {
+        while (!TryPush(item))
+        {
+            if (!Sleep([&](auto& lock) { return mCondition.wait(lock, stopToken, [this] { return !Full(); }); })) return false;
+        }
+        return true;
+    }
+
+    // Consumer. Wait for an item. Return false if stopped.
+    bool Pop(T& item, std::stop_token stopToken)
+    {
+        while (!TryPop(item))
+        {
+            if (!Sleep([&](auto& lock) { return mCondition.wait(lock, stopToken, [this] { return !Empty(); }); })) return false;
+        }
+        return true;
+    }
+
+    // Consumer. Wait for an item up to timeout. Return false if none came.
+    template <typename Rep, typename Period>
+    bool PopFor(T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        if (TryPop(item)) return true;
+        if (!Sleep([&](auto& lock) { return mCondition.wait_for(lock, timeout, [this] { return !Empty(); }); })) return false;
+        return TryPop(item);
+    }
+};
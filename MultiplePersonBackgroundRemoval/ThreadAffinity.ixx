@@ -0,0 +1,129 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <array>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Interface
+export module ThreadAffinity;
+
+// What a thread does. Each role can be pinned to its own cores.
+export enum class ThreadRole {
+    CAPTURE,    // SDK callback or polling thread.
+    CONVERT,    // One per camera. Frame set to Mats.
+    WORKER,     // Worker pool. Detect, segment and composite of all cameras.
+    PRESENT,    // Main thread. Display or sink.
+    COUNT
+};
+constexpr int NUM_ROLES = static_cast<int>(ThreadRole::COUNT);
+const std::array<std::string, NUM_ROLES> ROLE_NAMES = { "capture", "convert", "workers", "present" };
+
+// Cores per role, one bit per core. 0: not pinned, the OS schedules the thread anywhere.
+export struct ThreadPlacement
+{
+    std::array<uint64_t, NUM_ROLES> cpus{};
+    bool realtimeCapture = false;   // Highest priority for the capture thread. Opt-in, it can starve the system.
+};
+
+// "2", "4-7" or "0,2,4-5".
+export uint64_t ParseCpuSet(const std::string& text)
+{
+    uint64_t mask = 0;
+    size_t begin = 0;
+    while (begin <= text.size())
+    {
+        const size_t end = std::min(text.find(',', begin), text.size());
+        const std::string range = text.substr(begin, end - begin);
+        const size_t dash = range.find('-');
+        int first = -1, last = -1;
+        try {
+            size_t used = 0;
+            first = std::stoi(range, &used);
+            last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            if (dash == std::string::npos && used != range.size()) first = -1;
+        }
+        catch (const std::exception&) {}
+        if (first < 0 || last < first || last > 63) throw std::invalid_argument("Bad CPU set: " + text);
+        for (int cpu = first; cpu <= last; cpu++) mask |= uint64_t{ 1 } << cpu;
+        begin = end + 1;
+    }
+    return mask;
+}
+
+// "capture=2" sets the cores of one role.
+export void ParsePlacement(const std::string& text, ThreadPlacement& placement)
+{
+    const size_t equals = text.find('=');
+    const std::string role = text.substr(0, equals);
+    for (int i = 0; i < NUM_ROLES; i++)
+    {
+        if (ROLE_NAMES[i] != role || equals == std::string::npos) continue;
+        placement.cpus[i] = ParseCpuSet(text.substr(equals + 1));
+        return;
+    }
+    throw std::invalid_argument("Bad thread placement: " + text);
+}
+
+// Set once at startup, before the threads start.
+export void ConfigureThreads(const ThreadPlacement& placement);
+// Called by a thread when it starts. Pins it and sets its priority for its role.
+export void EnterRole(const ThreadRole role);
+
+module: private;
+
+static ThreadPlacement gPlacement;
+
+static bool PinCurrentThread(const uint64_t cpus)
+{
+#ifdef _WIN32
+    return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(cpus)) != 0;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < 64; cpu++)
+    {
+        if (cpus & (uint64_t{ 1 } << cpu)) CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+static bool RaiseCurrentThreadPriority()
+{
+#ifdef _WIN32
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+    sched_param param{};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#endif
+}
+
+void ConfigureThreads(const ThreadPlacement& placement)
+{
+    gPlacement = placement;
+}
+
+void EnterRole(const ThreadRole role)
+{
+    const int index = static_cast<int>(role);
+    const uint64_t cpus = gPlacement.cpus[index];
+    if (cpus && !PinCurrentThread(cpus)) {
+        std::cout << __FUNCTION__ << ": Cannot pin a " << ROLE_NAMES[index] << " thread." << std::endl;
+    }
+    if (role == ThreadRole::CAPTURE && gPlacement.realtimeCapture && !RaiseCurrentThreadPriority()) {
+        std::cout << __FUNCTION__ << ": Cannot raise the capture thread priority." << std::endl;
+    }
+}
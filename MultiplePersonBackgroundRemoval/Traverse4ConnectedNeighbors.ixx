@@ -22,10 +22,10 @@ constexpr int MARK_BINARY = 255;   // Mark for the connected zones on a binary i
 
 using namespace cv;
 
-// Return list of 4-connected neighbor points. 
-static std::vector<Point2i>& List4ConnectedNeighbors(const Point2i& centerPoint)
+// Return list of 4-connected neighbor points. Inside an image of the given size.
+static std::vector<Point2i>& List4ConnectedNeighbors(const Point2i& centerPoint, const Size& size)
 {
-    static std::vector<Point2i> neighbors(4);  // Static variable for speed.
+    thread_local std::vector<Point2i> neighbors(4);  // Static variable for speed. One per thread, cameras flood in parallel.
 
     neighbors.clear();
     // Check edge point.
@@ -33,9 +33,9 @@ static std::vector<Point2i>& List4ConnectedNeighbors(const Point2i& centerPoint)
         neighbors.emplace_back(Point2i(centerPoint.x - 1, centerPoint.y));
     if (centerPoint.y > 0)
         neighbors.emplace_back(Point2i(centerPoint.x, centerPoint.y - 1));
-    if (centerPoint.x < W_1)
+    if (centerPoint.x < size.width - 1)
         neighbors.emplace_back(Point2i(centerPoint.x + 1, centerPoint.y));
-    if (centerPoint.y < H_1)
+    if (centerPoint.y < size.height - 1)
         neighbors.emplace_back(Point2i(centerPoint.x, centerPoint.y + 1));
     return neighbors;
 }
@@ -64,7 +64,7 @@ export void DetectConnectedComponent(const Mat& imgDepth, const Point2i& center,
 {
     if (imgDepth.at<uint8_t>(center.y, center.x) == 0) return;  // Nothing there to detect.
 
-    static std::queue<Point2i> listToCheck;
+    thread_local std::queue<Point2i> listToCheck;
     assert(listToCheck.empty() && "List of points to check must be empty to start with.");
     imgConnectedMask.at<uint8_t>(center.y, center.x) = MARK_BINARY;   // Initial center marked.
     listToCheck.push(center);  // Starting point
@@ -79,7 +79,7 @@ export void DetectConnectedComponent(const Mat& imgDepth, const Point2i& center,
         const Point2i& centerPoint = listToCheck.front();  // Ref for speed. Get one zone at the front of the queue.
         DisplayZonesChecked(centerPoint, imgZonesConnected);
         const int centerDistance = imgDepth.at<uint8_t>(centerPoint.y, centerPoint.x);
-        for (const auto& pt : List4ConnectedNeighbors(centerPoint))
+        for (const auto& pt : List4ConnectedNeighbors(centerPoint, imgDepth.size()))
         {
             uint8_t& zoneByte = imgConnectedMask.at<uint8_t>(pt.y, pt.x);
             if (zoneByte) continue; // Already checked.
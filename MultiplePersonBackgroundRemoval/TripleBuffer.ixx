@@ -0,0 +1,66 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <stop_token>
+
+// Interface
+export module TripleBuffer;
+
+// Lock-free, latest-wins handoff from one writer thread to one reader thread.
+// The writer never blocks and always publishes its newest value. The reader always gets the newest one.
+export template <typename T>
+class TripleBuffer
+{
+private:
+    static constexpr uint8_t INDEX_MASK = 0x03;
+    static constexpr uint8_t FRESH = 0x04;   // Middle slot holds a value the reader has not taken yet.
+
+    T mSlots[3];
+    std::atomic<uint8_t> mMiddle{ 1 };    // Index of the shared slot, plus the FRESH bit.
+    uint8_t mBack = 0;                    // Writer owned slot.
+    uint8_t mFront = 2;                   // Reader owned slot.
+    std::atomic<uint64_t> mWritten{ 0 };
+    std::atomic<uint64_t> mOverwritten{ 0 };   // Published but never read.
+    std::atomic<uint32_t> mGeneration{ 0 };    // Bumped on every write and wake up. Waited on by the reader.
+
+public:
+    // Writer thread.
+    void Write(T value)
+    {
+        mSlots[mBack] = std::move(value);
+        const uint8_t previous = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel);
+        mBack = previous & INDEX_MASK;
+        if (previous & FRESH) mOverwritten.fetch_add(1, std::memory_order_relaxed);
+        mWritten.fetch_add(1, std::memory_order_relaxed);
+        mGeneration.fetch_add(1, std::memory_order_release);
+        mGeneration.notify_one();
+    }
+
+    // Reader thread. Sleep until something new is written or stop is requested.
+    void Wait(std::stop_token stopToken)
+    {
+        const uint32_t generation = mGeneration.load(std::memory_order_acquire);
+        if (mMiddle.load(std::memory_order_acquire) & FRESH) return;
+        std::stop_callback wakeUp(stopToken, [this] {
+            mGeneration.fetch_add(1, std::memory_order_release);
+            mGeneration.notify_all();
+        });
+        mGeneration.wait(generation, std::memory_order_acquire);
+    }
+
+    // Reader thread. Return false if nothing new was written since the last read.
+    bool Read(T& value)
+    {
+        if (!(mMiddle.load(std::memory_order_acquire) & FRESH)) return false;
+        const uint8_t previous = mMiddle.exchange(mFront, std::memory_order_acq_rel);
+        mFront = previous & INDEX_MASK;
+        value = std::move(mSlots[mFront]);
+        return true;
+    }
+
+    uint64_t Written() const noexcept { return mWritten.load(std::memory_order_relaxed); }
+    uint64_t Overwritten() const noexcept { return mOverwritten.load(std::memory_order_relaxed); }
+};
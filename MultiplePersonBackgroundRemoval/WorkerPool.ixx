@@ -0,0 +1,158 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <stop_token>
+#include <shared_mutex>
+#include <condition_variable>
+
+// Interface
+export module WorkerPool;
+
+import ThreadAffinity;
+
+// A fixed set of workers shared by the stages of all cameras.
+// A job is a non-blocking step that returns true if it did some work. A job never runs on two workers at once,
+// so its state needs no lock. Workers sweep the jobs round robin and sleep when a sweep finds nothing to do.
+export class WorkerPool
+{
+public:
+    using JobId = uint64_t;
+
+private:
+    struct Job
+    {
+        JobId id;
+        std::function<bool()> step;
+        std::atomic<bool> busy{ false };
+    };
+
+    std::vector<std::unique_ptr<Job>> mJobs;
+    std::shared_mutex mJobsMutex;               // Shared while sweeping. Exclusive to add or remove jobs.
+    JobId mNextId = 0;
+
+    std::atomic<uint64_t> mGeneration{ 0 };     // Bumped whenever a job may have become ready.
+    std::mutex mWakeMutex;
+    std::condition_variable_any mWakeCondition;
+
+    // Declared last. Stopped and joined first.
+    std::vector<std::jthread> mWorkers;
+
+    bool Sweep(size_t start);
+    void Run(const size_t index, std::stop_token stopToken);
+
+public:
+    explicit WorkerPool(const unsigned numWorkers);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    JobId Add(std::function<bool()> step);
+    // Wait for the job to finish its current step. It is never called again.
+    void Remove(const JobId id);
+
+    // Some job may be ready. Call after feeding a job from outside the pool.
+    void Notify();
+
+    // For threads outside the pool. Sleep until any job did some work after generation, up to timeout.
+    uint64_t Generation() const noexcept { return mGeneration.load(std::memory_order_acquire); }
+    void WaitProgress(const uint64_t generation, const std::chrono::milliseconds timeout);
+
+    size_t Size() const noexcept { return mWorkers.size(); }
+};
+
+module: private;
+
+WorkerPool::WorkerPool(const unsigned numWorkers)
+{
+    mWorkers.reserve(numWorkers);
+    for (unsigned i = 0; i < numWorkers; i++)
+    {
+        mWorkers.emplace_back([this, i](std::stop_token stopToken) { Run(i, stopToken); });
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    for (auto& worker : mWorkers) worker.request_stop();
+    mWakeCondition.notify_all();
+    mWorkers.clear();
+}
+
+WorkerPool::JobId WorkerPool::Add(std::function<bool()> step)
+{
+    JobId id;
+    {
+        std::unique_lock<std::shared_mutex> lock(mJobsMutex);
+        id = mNextId++;
+        auto job = std::make_unique<Job>();
+        job->id = id;
+        job->step = std::move(step);
+        mJobs.push_back(std::move(job));
+    }
+    Notify();
+    return id;
+}
+
+void WorkerPool::Remove(const JobId id)
+{
+    // Sweeps hold the shared lock while a step runs, so no step is running once this is granted.
+    std::unique_lock<std::shared_mutex> lock(mJobsMutex);
+    std::erase_if(mJobs, [id](const std::unique_ptr<Job>& job) { return job->id == id; });
+}
+
+void WorkerPool::Notify()
+{
+    mGeneration.fetch_add(1, std::memory_order_release);
+    { std::lock_guard<std::mutex> lock(mWakeMutex); }
+    mWakeCondition.notify_all();
+}
+
+void WorkerPool::WaitProgress(const uint64_t generation, const std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mWakeMutex);
+    mWakeCondition.wait_for(lock, timeout, [this, generation] { return Generation() != generation; });
+}
+
+// One pass over all jobs, starting at a different job per worker. Return true if any job did some work.
+bool WorkerPool::Sweep(size_t start)
+{
+    std::shared_lock<std::shared_mutex> lock(mJobsMutex);
+    const size_t count = mJobs.size();
+    bool worked = false;
+    for (size_t n = 0; n < count; n++)
+    {
+        Job& job = *mJobs[(start + n) % count];
+        // Acquire and release on the busy flag hand the job state from one worker to the next.
+        if (job.busy.exchange(true, std::memory_order_acquire)) continue;
+        const bool didWork = job.step();
+        job.busy.store(false, std::memory_order_release);
+        if (didWork) {
+            worked = true;
+            Notify();   // The next stage of this camera may be ready now. Wake a sleeping worker for it.
+        }
+    }
+    return worked;
+}
+
+void WorkerPool::Run(const size_t index, std::stop_token stopToken)
+{
+    EnterRole(ThreadRole::WORKER);
+    size_t start = index;
+    while (!stopToken.stop_requested())
+    {
+        const uint64_t generation = Generation();
+        if (Sweep(start++)) continue;
+
+        // Nothing ready. Sleep until someone feeds a job.
+        std::unique_lock<std::mutex> lock(mWakeMutex);
+        mWakeCondition.wait(lock, stopToken, [this, generation] { return Generation() != generation; });
+    }
+}
@@ -0,0 +1,273 @@
+// © Copyright 2022 Farmhand.
+
+module;  // global module fragment area. Put #include directives here
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#pragma warning(disable: 5054 6294 6201 6269)
+#include <opencv2/opencv.hpp>
+
+// Interface
+export module YuvColor;
+
+import CompositeKernel;
+
+using namespace cv;
+
+// YUV color as the camera delivers it. 4:2:0 is one CV_8UC1 Mat of height * 3 / 2 rows, 4:2:2 a CV_8UC2 Mat.
+export enum class YuvLayout {
+    NONE,
+    NV12,    // 4:2:0. Y plane, then interleaved U V.
+    NV21,    // 4:2:0. Y plane, then interleaved V U.
+    I420,    // 4:2:0. Y plane, U plane, V plane.
+    YUYV,    // 4:2:2 packed. Y0 U Y1 V.
+    UYVY     // 4:2:2 packed. U Y0 V Y1.
+};
+
+// Header over the frame buffer. No copy.
+export Mat WrapYuv(void* data, const int width, const int height, const YuvLayout layout);
+// Pixel size of a wrapped frame.
+export Size YuvSize(const Mat& yuv, const YuvLayout layout);
+// Four character code for the sinks, e.g. "NV12". 0 for NONE.
+export uint32_t YuvFourcc(const YuvLayout layout);
+
+// Full frame to BGR. OpenCV's vectorized conversion.
+export void YuvToBgr(const Mat& yuv, const YuvLayout layout, Mat& imgBgr);
+// The luma plane. A header for 4:2:0, extracted for 4:2:2.
+export void YuvLuma(const Mat& yuv, const YuvLayout layout, Mat& imgLuma);
+// Fused convert and downscale: BGR at 1 / 2^shift, each pixel from the mean of its block. The detector input
+// comes straight from YUV, without a full size BGR image in between.
+export void YuvToBgrScaled(const Mat& yuv, const YuvLayout layout, const int shift, Mat& imgBgr);
+
+// Person pixels converted to BGR, background elsewhere. The background is never converted.
+// imgMask may be an alpha matte. Partly covered pixels are blended.
+export void CompositeYuvToBgr(const Mat& yuv, const YuvLayout layout, const Mat& imgMask, const Scalar& background,
+    Mat& imgOut);
+// Same, staying in YUV for sinks that take it. imgOut has the layout of yuv. A chroma sample shared by several
+// pixels is the person's if at least half of them are.
+export void CompositeYuv(const Mat& yuv, const YuvLayout layout, const Mat& imgMask, const Scalar& background,
+    Mat& imgOut);
+
+module: private;
+
+constexpr bool Is420(const YuvLayout layout)
+{
+    return layout == YuvLayout::NV12 || layout == YuvLayout::NV21 || layout == YuvLayout::I420;
+}
+
+// Byte offsets in a tightly packed w x h frame. (cx, cy) is a chroma sample: 2 x 2 pixels for 4:2:0, 2 x 1 for 4:2:2.
+template <YuvLayout L>
+struct Offsets
+{
+    static constexpr int CHROMA_SHIFT_Y = Is420(L) ? 1 : 0;
+
+    static size_t Y(const int w, const int, const int x, const int y)
+    {
+        if constexpr (Is420(L)) return static_cast<size_t>(y) * w + x;
+        else if constexpr (L == YuvLayout::YUYV) return (static_cast<size_t>(y) * w + x) * 2;
+        else return (static_cast<size_t>(y) * w + x) * 2 + 1;
+    }
+    static size_t U(const int w, const int h, const int cx, const int cy)
+    {
+        if constexpr (L == YuvLayout::NV12) return static_cast<size_t>(h + cy) * w + cx * 2;
+        else if constexpr (L == YuvLayout::NV21) return static_cast<size_t>(h + cy) * w + cx * 2 + 1;
+        else if constexpr (L == YuvLayout::I420) return static_cast<size_t>(w) * h + static_cast<size_t>(cy) * (w / 2) + cx;
+        else if constexpr (L == YuvLayout::YUYV) return (static_cast<size_t>(cy) * w + cx * 2) * 2 + 1;
+        else return (static_cast<size_t>(cy) * w + cx * 2) * 2;
+    }
+    static size_t V(const int w, const int h, const int cx, const int cy)
+    {
+        if constexpr (L == YuvLayout::NV12) return static_cast<size_t>(h + cy) * w + cx * 2 + 1;
+        else if constexpr (L == YuvLayout::NV21) return static_cast<size_t>(h + cy) * w + cx * 2;
+        else if constexpr (L == YuvLayout::I420)
+            return static_cast<size_t>(w) * h + static_cast<size_t>(w / 2) * (h / 2) + static_cast<size_t>(cy) * (w / 2) + cx;
+        else if constexpr (L == YuvLayout::YUYV) return (static_cast<size_t>(cy) * w + cx * 2) * 2 + 3;
+        else return (static_cast<size_t>(cy) * w + cx * 2) * 2 + 2;
+    }
+};
+
+// Call work with the layout as a compile time constant, so the pixel loops have no branches on it.
+template <typename Work>
+static void WithLayout(const YuvLayout layout, Work work)
+{
+    switch (layout) {
+    case YuvLayout::NV12: work(std::integral_constant<YuvLayout, YuvLayout::NV12>{}); break;
+    case YuvLayout::NV21: work(std::integral_constant<YuvLayout, YuvLayout::NV21>{}); break;
+    case YuvLayout::I420: work(std::integral_constant<YuvLayout, YuvLayout::I420>{}); break;
+    case YuvLayout::YUYV: work(std::integral_constant<YuvLayout, YuvLayout::YUYV>{}); break;
+    case YuvLayout::UYVY: work(std::integral_constant<YuvLayout, YuvLayout::UYVY>{}); break;
+    default: CV_Error(Error::StsBadArg, "Not a YUV layout");
+    }
+}
+
+// BT.601 limited range, the fixed point coefficients of OpenCV's YUV to BGR.
+constexpr int CY = 1220542, CUB = 2116026, CUG = -409993, CVG = -852492, CVR = 1673527;
+constexpr int COEFF_SHIFT = 20;
+
+static inline Vec3b ToBgr(const int y, const int u, const int v)
+{
+    const int luma = std::max(0, y - 16) * CY;
+    const int round = 1 << (COEFF_SHIFT - 1);
+    return Vec3b(saturate_cast<uint8_t>((luma + CUB * (u - 128) + round) >> COEFF_SHIFT),
+        saturate_cast<uint8_t>((luma + CUG * (u - 128) + CVG * (v - 128) + round) >> COEFF_SHIFT),
+        saturate_cast<uint8_t>((luma + CVR * (v - 128) + round) >> COEFF_SHIFT));
+}
+
+static inline Vec3b ToYuv(const Scalar& bgr)
+{
+    const int b = saturate_cast<uint8_t>(bgr[0]), g = saturate_cast<uint8_t>(bgr[1]), r = saturate_cast<uint8_t>(bgr[2]);
+    return Vec3b(saturate_cast<uint8_t>(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8)),
+        saturate_cast<uint8_t>(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8)),
+        saturate_cast<uint8_t>(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8)));
+}
+
+Mat WrapYuv(void* data, const int width, const int height, const YuvLayout layout)
+{
+    return Is420(layout) ? Mat(height * 3 / 2, width, CV_8UC1, data) : Mat(height, width, CV_8UC2, data);
+}
+
+Size YuvSize(const Mat& yuv, const YuvLayout layout)
+{
+    return Is420(layout) ? Size(yuv.cols, yuv.rows * 2 / 3) : yuv.size();
+}
+
+uint32_t YuvFourcc(const YuvLayout layout)
+{
+    switch (layout) {
+    case YuvLayout::NV12: return VideoWriter::fourcc('N', 'V', '1', '2');
+    case YuvLayout::NV21: return VideoWriter::fourcc('N', 'V', '2', '1');
+    case YuvLayout::I420: return VideoWriter::fourcc('I', '4', '2', '0');
+    case YuvLayout::YUYV: return VideoWriter::fourcc('Y', 'U', 'Y', '2');
+    case YuvLayout::UYVY: return VideoWriter::fourcc('U', 'Y', 'V', 'Y');
+    default: return 0;
+    }
+}
+
+void YuvToBgr(const Mat& yuv, const YuvLayout layout, Mat& imgBgr)
+{
+    switch (layout) {
+    case YuvLayout::NV12: cvtColor(yuv, imgBgr, COLOR_YUV2BGR_NV12); break;
+    case YuvLayout::NV21: cvtColor(yuv, imgBgr, COLOR_YUV2BGR_NV21); break;
+    case YuvLayout::I420: cvtColor(yuv, imgBgr, COLOR_YUV2BGR_I420); break;
+    case YuvLayout::YUYV: cvtColor(yuv, imgBgr, COLOR_YUV2BGR_YUY2); break;
+    case YuvLayout::UYVY: cvtColor(yuv, imgBgr, COLOR_YUV2BGR_UYVY); break;
+    default: CV_Error(Error::StsBadArg, "Not a YUV layout");
+    }
+}
+
+void YuvLuma(const Mat& yuv, const YuvLayout layout, Mat& imgLuma)
+{
+    if (Is420(layout)) imgLuma = yuv.rowRange(0, yuv.rows * 2 / 3);
+    else extractChannel(yuv, imgLuma, layout == YuvLayout::YUYV ? 0 : 1);
+}
+
+void YuvToBgrScaled(const Mat& yuv, const YuvLayout layout, const int shift, Mat& imgBgr)
+{
+    CV_Assert(yuv.isContinuous() && shift >= 1);
+    const Size size = YuvSize(yuv, layout);
+    const int block = 1 << shift;
+    imgBgr.create(size.height >> shift, size.width >> shift, CV_8UC3);
+    const int area = block * block;
+    WithLayout(layout, [&](auto tag) {
+        using O = Offsets<decltype(tag)::value>;
+        const uint8_t* data = yuv.ptr<uint8_t>();
+        const int w = size.width, h = size.height;
+        for (int oy = 0; oy < imgBgr.rows; oy++)
+        {
+            Vec3b* out = imgBgr.ptr<Vec3b>(oy);
+            for (int ox = 0; ox < imgBgr.cols; ox++)
+            {
+                // Luma of every pixel in the block, chroma of every sample. Blocks are a whole number of samples.
+                int sumY = 0, sumU = 0, sumV = 0;
+                const int x0 = ox << shift, y0 = oy << shift;
+                for (int y = y0; y < y0 + block; y++)
+                {
+                    for (int x = x0; x < x0 + block; x++) sumY += data[O::Y(w, h, x, y)];
+                }
+                const int cy0 = y0 >> O::CHROMA_SHIFT_Y, cyEnd = (y0 + block) >> O::CHROMA_SHIFT_Y;
+                for (int cy = cy0; cy < cyEnd; cy++)
+                {
+                    for (int cx = x0 >> 1; cx < (x0 + block) >> 1; cx++)
+                    {
+                        sumU += data[O::U(w, h, cx, cy)];
+                        sumV += data[O::V(w, h, cx, cy)];
+                    }
+                }
+                const int samples = (cyEnd - cy0) * (block >> 1);
+                out[ox] = ToBgr((sumY + area / 2) / area, (sumU + samples / 2) / samples, (sumV + samples / 2) / samples);
+            }
+        }
+    });
+}
+
+void CompositeYuvToBgr(const Mat& yuv, const YuvLayout layout, const Mat& imgMask, const Scalar& background,
+    Mat& imgOut)
+{
+    CV_Assert(yuv.isContinuous());
+    const Size size = YuvSize(yuv, layout);
+    const Vec3b bgr(saturate_cast<uint8_t>(background[0]), saturate_cast<uint8_t>(background[1]),
+        saturate_cast<uint8_t>(background[2]));
+    imgOut.create(size, CV_8UC3);
+    WithLayout(layout, [&](auto tag) {
+        using O = Offsets<decltype(tag)::value>;
+        const uint8_t* data = yuv.ptr<uint8_t>();
+        const int w = size.width, h = size.height;
+        for (int y = 0; y < h; y++)
+        {
+            const uint8_t* mask = imgMask.ptr<uint8_t>(y);
+            Vec3b* out = imgOut.ptr<Vec3b>(y);
+            const int cy = y >> O::CHROMA_SHIFT_Y;
+            for (int x = 0; x < w; x++)
+            {
+                const int a = mask[x];
+                if (a == 0) {
+                    out[x] = bgr;
+                    continue;
+                }
+                const Vec3b person = ToBgr(data[O::Y(w, h, x, y)], data[O::U(w, h, x >> 1, cy)], data[O::V(w, h, x >> 1, cy)]);
+                out[x] = a == 255 ? person
+                    : Vec3b(Blend(person[0], bgr[0], a), Blend(person[1], bgr[1], a), Blend(person[2], bgr[2], a));
+            }
+        }
+    });
+}
+
+void CompositeYuv(const Mat& yuv, const YuvLayout layout, const Mat& imgMask, const Scalar& background, Mat& imgOut)
+{
+    CV_Assert(yuv.isContinuous());
+    const Size size = YuvSize(yuv, layout);
+    const Vec3b bgYuv = ToYuv(background);
+    imgOut.create(yuv.size(), yuv.type());
+    WithLayout(layout, [&](auto tag) {
+        using O = Offsets<decltype(tag)::value>;
+        const uint8_t* in = yuv.ptr<uint8_t>();
+        uint8_t* out = imgOut.ptr<uint8_t>();
+        const int w = size.width, h = size.height;
+        for (int y = 0; y < h; y++)
+        {
+            const uint8_t* mask = imgMask.ptr<uint8_t>(y);
+            for (int x = 0; x < w; x++)
+            {
+                const size_t i = O::Y(w, h, x, y);
+                out[i] = mask[x] ? in[i] : bgYuv[0];
+            }
+        }
+        const int rowsPerSample = 1 << O::CHROMA_SHIFT_Y;
+        for (int cy = 0; cy < h / rowsPerSample; cy++)
+        {
+            for (int cx = 0; cx < w / 2; cx++)
+            {
+                int person = 0;
+                for (int y = cy * rowsPerSample; y < (cy + 1) * rowsPerSample; y++)
+                {
+                    const uint8_t* mask = imgMask.ptr<uint8_t>(y);
+                    person += (mask[cx * 2] != 0) + (mask[cx * 2 + 1] != 0);
+                }
+                const bool keep = person >= rowsPerSample;   // Half of the 2 x rowsPerSample pixels.
+                const size_t u = O::U(w, h, cx, cy), v = O::V(w, h, cx, cy);
+                out[u] = keep ? in[u] : bgYuv[1];
+                out[v] = keep ? in[v] : bgYuv[2];
+            }
+        }
+    });
+}
@@ -0,0 +1,18 @@
+// © Copyright 2022 Farmhand.
+
+// SIMD paths compiled into this build, for the global module fragment of each kernel module. Whether the CPU
+// runs them is checked at run time, see BestSimdPath in SimdPath.ixx.
+
+#pragma once
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define SIMD_SSE2 1
+#include <immintrin.h>
+#endif
+#if defined(SIMD_SSE2) && (defined(_M_X64) || defined(__SSSE3__))
+#define SIMD_SSSE3 1
+#endif
+// MSVC compiles AVX2 intrinsics without /arch:AVX2. The path is only taken if the CPU has it.
+#if defined(SIMD_SSE2) && (defined(_MSC_VER) || defined(__AVX2__))
+#define SIMD_AVX2 1
+#endif
@@ -13,7 +13,7 @@
 constexpr int ESC = 27;
 
 //快速取平方根的倒数
-float Q_rsqrt(const float number) noexcept
+inline float Q_rsqrt(const float number) noexcept
 {
     constexpr float threehalfs = 1.5F;
     const float x2 = number * 0.5F;
@@ -42,6 +42,7 @@ private:
     bool        mWindowClose = false;
     int         mKeyPressed = -1;
     bool        mShowInfo = false;
+    mutable cv::Mat mOutMat;            // Rows of panels. Reused while the panel sizes stay the same.
     int         mAverageColorFps = 0;
     int         mAverageDepthFps = 0;
     int         mAverageIrFps = 0;
@@ -125,42 +126,7 @@ public:
 
             int     averageFps = mAverageColorFps;
             cv::Mat rstMat;
-
-            if (videoFrame->type() == OB_FRAME_COLOR) {
-                if (videoFrame->format() == OB_FORMAT_MJPG) {
-                    cv::Mat rawMat(1, videoFrame->dataSize(), CV_8UC1, videoFrame->data());
-                    rstMat = cv::imdecode(rawMat, 1);
-                }
-                else if (videoFrame->format() == OB_FORMAT_NV21) {
-                    cv::Mat rawMat(videoFrame->height() * 3 / 2, videoFrame->width(), CV_8UC1, videoFrame->data());
-                    cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_NV21);
-                }
-                else if (videoFrame->format() == OB_FORMAT_YUYV || videoFrame->format() == OB_FORMAT_YUY2) {
-                    cv::Mat rawMat(videoFrame->height(), videoFrame->width(), CV_8UC2, videoFrame->data());
-                    cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_YUY2);
-                }
-                else if (videoFrame->format() == OB_FORMAT_RGB888) {
-                    cv::Mat rawMat(videoFrame->height(), videoFrame->width(), CV_8UC3, videoFrame->data());
-                    cv::cvtColor(rawMat, rstMat, cv::COLOR_RGB2BGR);
-                }
-            }
-            else if (videoFrame->format() == OB_FORMAT_Y16 || videoFrame->format() == OB_FORMAT_YUYV
-                || videoFrame->format() == OB_FORMAT_YUY2) {
-                // IR or Depth Frame
-                cv::Mat rawMat = cv::Mat(videoFrame->height(), videoFrame->width(), CV_16UC1, videoFrame->data());
-                double scale;
-                if (videoFrame->type() == OB_FRAME_DEPTH) {
-                    scale = 1.0f / pow(2, videoFrame->pixelAvailableBitSize() - 10);
-                }
-                else {
-                    scale = 1.0f / pow(2, videoFrame->pixelAvailableBitSize() - 8);
-                }
-                // 12 bit distance value, max 4095
-                cv::convertScaleAbs(rawMat, rstMat, scale /* 0.0625==1/16==14bit */);  // Gray scale only.
-                //cv::Mat cvtMat;
-                //cv::convertScaleAbs(rawMat, cvtMat, scale /* 0.0625 */);
-                //cv::cvtColor(cvtMat, rstMat, cv::COLOR_GRAY2RGB);
-            }
+            convertFrame(*videoFrame, rstMat);
 
             if (videoFrame->type() == OB_FRAME_DEPTH) {
                 averageFps = mAverageDepthFps;
@@ -177,6 +143,59 @@ public:
         return mats;
     }
 
+    // Convert a frame to BGR color, or to 8-bit gray for IR and depth. rstMat is reused if it has the right shape.
+    // Thread safe. No window state is touched.
+    static void convertFrame(ob::VideoFrame& frame, cv::Mat& rstMat)
+    {
+        if (frame.type() == OB_FRAME_COLOR) {
+            if (frame.format() == OB_FORMAT_MJPG) {
+                cv::Mat rawMat(1, frame.dataSize(), CV_8UC1, frame.data());
+                rstMat = cv::imdecode(rawMat, 1);
+            }
+            else if (frame.format() == OB_FORMAT_NV21) {
+                cv::Mat rawMat(frame.height() * 3 / 2, frame.width(), CV_8UC1, frame.data());
+                cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_NV21);
+            }
+            else if (frame.format() == OB_FORMAT_NV12) {
+                cv::Mat rawMat(frame.height() * 3 / 2, frame.width(), CV_8UC1, frame.data());
+                cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_NV12);
+            }
+            else if (frame.format() == OB_FORMAT_I420) {
+                cv::Mat rawMat(frame.height() * 3 / 2, frame.width(), CV_8UC1, frame.data());
+                cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_I420);
+            }
+            else if (frame.format() == OB_FORMAT_YUYV || frame.format() == OB_FORMAT_YUY2) {
+                cv::Mat rawMat(frame.height(), frame.width(), CV_8UC2, frame.data());
+                cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_YUY2);
+            }
+            else if (frame.format() == OB_FORMAT_UYVY) {
+                cv::Mat rawMat(frame.height(), frame.width(), CV_8UC2, frame.data());
+                cv::cvtColor(rawMat, rstMat, cv::COLOR_YUV2BGR_UYVY);
+            }
+            else if (frame.format() == OB_FORMAT_RGB888) {
+                cv::Mat rawMat(frame.height(), frame.width(), CV_8UC3, frame.data());
+                cv::cvtColor(rawMat, rstMat, cv::COLOR_RGB2BGR);
+            }
+        }
+        else if (frame.format() == OB_FORMAT_Y16 || frame.format() == OB_FORMAT_YUYV
+            || frame.format() == OB_FORMAT_YUY2) {
+            // IR or Depth Frame
+            cv::Mat rawMat = cv::Mat(frame.height(), frame.width(), CV_16UC1, frame.data());
+            double scale;
+            if (frame.type() == OB_FRAME_DEPTH) {
+                scale = 1.0f / pow(2, frame.pixelAvailableBitSize() - 10);
+            }
+            else {
+                scale = 1.0f / pow(2, frame.pixelAvailableBitSize() - 8);
+            }
+            // 12 bit distance value, max 4095
+            cv::convertScaleAbs(rawMat, rstMat, scale /* 0.0625==1/16==14bit */);  // Gray scale only.
+            //cv::Mat cvtMat;
+            //cv::convertScaleAbs(rawMat, cvtMat, scale /* 0.0625 */);
+            //cv::cvtColor(cvtMat, rstMat, cv::COLOR_GRAY2RGB);
+        }
+    }
+
     static void drawInfo(cv::Mat& imageMat, ob::VideoFrame& frame, const int averageFps) {
         const auto fontColor = cv::Scalar(255, 0, 255);
 
@@ -218,15 +237,9 @@ public:
             break;
 
         case RenderType::RENDER_ONE_ROW:
-            for (const auto& mat : mats) {
-                if (outMat.dims > 0) {
-                    cv::hconcat(outMat, mat, outMat);
-                }
-                else {
-                    outMat = mat;
-                }
-            }
-            cv::imshow(mTitle, outMat);
+            // All panels in one go, into the same buffer every frame.
+            cv::hconcat(mats, mOutMat);
+            cv::imshow(mTitle, mOutMat);
             break;
 
         case RenderType::RENDER_ONE_COLOUMN: